@@ -0,0 +1,123 @@
+#include "backoff.h"
+
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+void backoff_seed(const char* bismark_id) {
+  unsigned int seed = time(NULL) ^ getpid();
+  while (*bismark_id) {
+    seed = seed * 33 + (unsigned char)*bismark_id++;
+  }
+  srandom(seed);
+}
+
+time_t backoff_jitter(time_t delay) {
+  time_t half = delay / 2;
+  if (delay - half <= 0) {
+    return delay;
+  }
+  return half + random() % (delay - half + 1);
+}
+
+time_t backoff_delay(int attempts, time_t base_delay, time_t max_delay) {
+  time_t delay = base_delay;
+  while (--attempts > 0 && delay < max_delay) {
+    delay *= 2;
+  }
+  if (delay > max_delay) {
+    delay = max_delay;
+  }
+  return backoff_jitter(delay);
+}
+
+void circuit_breaker_init(circuit_breaker_t* breaker,
+                          int threshold,
+                          time_t base_cooldown,
+                          time_t max_cooldown) {
+  breaker->state = CIRCUIT_CLOSED;
+  breaker->consecutive_failures = 0;
+  breaker->threshold = threshold;
+  breaker->base_cooldown = base_cooldown;
+  breaker->max_cooldown = max_cooldown;
+  breaker->cooldown = base_cooldown;
+  breaker->open_until = 0;
+  breaker->probe_in_flight = 0;
+}
+
+static void open_circuit(circuit_breaker_t* breaker, time_t current_time) {
+  breaker->state = CIRCUIT_OPEN;
+  breaker->open_until = current_time + backoff_jitter(breaker->cooldown);
+  breaker->probe_in_flight = 0;
+  syslog(LOG_WARNING,
+         "Server unreachable; pausing uploads for %ld seconds",
+         (long)(breaker->open_until - current_time));
+}
+
+int circuit_breaker_allow(circuit_breaker_t* breaker, time_t current_time) {
+  switch (breaker->state) {
+    case CIRCUIT_CLOSED:
+      return 1;
+    case CIRCUIT_OPEN:
+      if (current_time < breaker->open_until) {
+        return 0;
+      }
+      syslog(LOG_INFO, "Probing server before resuming uploads");
+      breaker->state = CIRCUIT_HALF_OPEN;
+      breaker->probe_in_flight = 1;
+      return 1;
+    case CIRCUIT_HALF_OPEN:
+      if (breaker->probe_in_flight) {
+        return 0;
+      }
+      breaker->probe_in_flight = 1;
+      return 1;
+  }
+  return 0;
+}
+
+time_t circuit_breaker_ready_time(const circuit_breaker_t* breaker) {
+  switch (breaker->state) {
+    case CIRCUIT_OPEN:
+      return breaker->open_until;
+    case CIRCUIT_HALF_OPEN:
+      return breaker->probe_in_flight ? -1 : 0;
+    default:
+      return 0;
+  }
+}
+
+void circuit_breaker_record(circuit_breaker_t* breaker,
+                            upload_outcome_t outcome,
+                            time_t current_time) {
+  switch (outcome) {
+    case UPLOAD_OUTCOME_SUCCESS:
+      if (breaker->state != CIRCUIT_CLOSED) {
+        syslog(LOG_INFO, "Server reachable again; resuming uploads");
+      }
+      breaker->state = CIRCUIT_CLOSED;
+      breaker->consecutive_failures = 0;
+      breaker->cooldown = breaker->base_cooldown;
+      breaker->probe_in_flight = 0;
+      break;
+
+    case UPLOAD_OUTCOME_SERVER_FAILURE:
+      ++breaker->consecutive_failures;
+      if (breaker->state == CIRCUIT_HALF_OPEN) {
+        breaker->cooldown *= 2;
+        if (breaker->cooldown > breaker->max_cooldown) {
+          breaker->cooldown = breaker->max_cooldown;
+        }
+        open_circuit(breaker, current_time);
+      } else if (breaker->state == CIRCUIT_CLOSED
+          && breaker->consecutive_failures >= breaker->threshold) {
+        open_circuit(breaker, current_time);
+      }
+      break;
+
+    case UPLOAD_OUTCOME_OTHER_FAILURE:
+      /* A probe that failed for local reasons proved nothing; try again. */
+      breaker->probe_in_flight = 0;
+      break;
+  }
+}
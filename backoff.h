@@ -0,0 +1,60 @@
+#ifndef _BISMARK_DATA_TRANSMIT_BACKOFF_H_
+#define _BISMARK_DATA_TRANSMIT_BACKOFF_H_
+
+#include <time.h>
+
+/* Seed the jitter so routers that fail together don't retry together. */
+void backoff_seed(const char* bismark_id);
+
+/* Pick a delay uniformly from [delay / 2, delay]. */
+time_t backoff_jitter(time_t delay);
+
+/* Seconds to wait before retrying a file that has failed attempts times:
+ * base_delay doubled for every failure after the first, capped at
+ * max_delay, and jittered. */
+time_t backoff_delay(int attempts, time_t base_delay, time_t max_delay);
+
+typedef enum {
+  CIRCUIT_CLOSED,     /* Uploads flow normally. */
+  CIRCUIT_OPEN,       /* The server looks down; no uploads until open_until. */
+  CIRCUIT_HALF_OPEN   /* One probe upload is allowed to test the server. */
+} circuit_state_t;
+
+typedef enum {
+  UPLOAD_OUTCOME_SUCCESS,
+  UPLOAD_OUTCOME_SERVER_FAILURE,  /* Couldn't reach the server, or it failed. */
+  UPLOAD_OUTCOME_OTHER_FAILURE    /* Says nothing about the server's health. */
+} upload_outcome_t;
+
+/* Stops all uploads after threshold consecutive server failures. After a
+ * cooldown a single probe upload is let through; if it succeeds uploads
+ * resume, otherwise the breaker opens again for twice as long. */
+typedef struct {
+  circuit_state_t state;
+  int consecutive_failures;
+  int threshold;
+  time_t cooldown;
+  time_t base_cooldown;
+  time_t max_cooldown;
+  time_t open_until;
+  int probe_in_flight;
+} circuit_breaker_t;
+
+void circuit_breaker_init(circuit_breaker_t* breaker,
+                          int threshold,
+                          time_t base_cooldown,
+                          time_t max_cooldown);
+
+/* Return 1 if an upload may start now. In the half open state this hands
+ * out the single probe, so only call it when actually starting an upload. */
+int circuit_breaker_allow(circuit_breaker_t* breaker, time_t current_time);
+
+/* When uploads may start again: 0 if they may start now and -1 if that
+ * depends on a probe that is still in flight. */
+time_t circuit_breaker_ready_time(const circuit_breaker_t* breaker);
+
+void circuit_breaker_record(circuit_breaker_t* breaker,
+                            upload_outcome_t outcome,
+                            time_t current_time);
+
+#endif
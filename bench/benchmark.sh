@@ -0,0 +1,236 @@
+#!/bin/sh
+#
+# Measure how fast bismark-data-transmit drains synthetic workloads into a
+# local stand-in server. Run it with `make benchmark`, which passes CC, SRCS
+# and LIBS. Everything else is set through the environment:
+#
+#   BENCH_DIR           scratch directory (/tmp/bismark-data-transmit-bench)
+#   BENCH_PORT          port of the stand-in server (18080)
+#   BENCH_LATENCY       seconds the server waits before answering (0)
+#   BENCH_BANDWIDTH     server's total upload rate in bytes/second (0: no cap)
+#   BENCH_ERROR_RATE    share of uploads the server fails with a 500 (0)
+#   BENCH_TLS           1 to upload over HTTPS with a self-signed certificate
+#   BENCH_WORKLOADS     which workloads to run ("small large dirs")
+#   BENCH_TIMEOUT       seconds to wait for a workload to drain (300)
+#
+# The workloads:
+#
+#   small  SMALL_FILES (2000) files of SMALL_SIZE (1024) bytes moved into
+#          SMALL_DIRECTORIES (4) directories in bursts of SMALL_BURST (200)
+#          files every BURST_INTERVAL (0.1) seconds.
+#   large  LARGE_FILES (8) files of LARGE_SIZE (16 MB).
+#   dirs   NEW_DIRECTORIES (100) directories of DIRECTORY_FILES (10) files
+#          each, moved into UPLOADS_ROOT while the daemon runs.
+#
+# Every workload gets a fresh daemon. The report gives the time from the
+# first file arriving to the last one being deleted after its upload, the
+# resulting rates, and the daemon's CPU time and peak RSS.
+
+set -e
+
+: "${CC:=gcc}"
+: "${LIBS:=-lcurl -lz -lssl -lcrypto}"
+: "${BENCH_DIR:=/tmp/bismark-data-transmit-bench}"
+: "${BENCH_PORT:=18080}"
+: "${BENCH_LATENCY:=0}"
+: "${BENCH_BANDWIDTH:=0}"
+: "${BENCH_ERROR_RATE:=0}"
+: "${BENCH_TLS:=0}"
+: "${BENCH_WORKLOADS:=small large dirs}"
+: "${BENCH_TIMEOUT:=300}"
+: "${SMALL_FILES:=2000}"
+: "${SMALL_SIZE:=1024}"
+: "${SMALL_DIRECTORIES:=4}"
+: "${SMALL_BURST:=200}"
+: "${BURST_INTERVAL:=0.1}"
+: "${LARGE_FILES:=8}"
+: "${LARGE_SIZE:=16777216}"
+: "${NEW_DIRECTORIES:=100}"
+: "${DIRECTORY_FILES:=10}"
+
+BENCH_SCRIPTS=$(cd "$(dirname "$0")" && pwd)
+UPLOADS="$BENCH_DIR/uploads"
+STAGING="$BENCH_DIR/staging"
+DAEMON="$BENCH_DIR/bismark-data-transmit"
+
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR"
+printf 'BENCHMARK00000' > "$BENCH_DIR/id"
+: > "$BENCH_DIR/config"
+
+# Build a daemon that lives entirely inside BENCH_DIR and retries at once.
+echo "Building $DAEMON"
+SCHEME=http
+TLS_FLAGS=
+if [ "$BENCH_TLS" = 1 ]; then
+  SCHEME=https
+  TLS_FLAGS=-DSKIP_SSL_VERIFICATION=yes
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=127.0.0.1 \
+      -keyout "$BENCH_DIR/key.pem" -out "$BENCH_DIR/cert.pem" 2>/dev/null
+fi
+$CC -O3 -fno-strict-aliasing $TLS_FLAGS \
+    -DUPLOADS_ROOT="\"$UPLOADS\"" \
+    -DBISMARK_ID_FILENAME="\"$BENCH_DIR/id\"" \
+    -DCONFIG_FILENAME="\"$BENCH_DIR/config\"" \
+    -DJOURNAL_FILENAME="\"$BENCH_DIR/journal\"" \
+    -DMETRICS_FILENAME="\"$BENCH_DIR/metrics.prom\"" \
+    -DFAILURES_LOG="\"$BENCH_DIR/failures.log\"" \
+    -DRETRY_INTERVAL_MINUTES=0 \
+    -DMAX_UPLOADS_BYTES="((size_t)1 << 30)" \
+    $SRCS -o "$DAEMON" $LIBS
+
+if [ "$BENCH_TLS" = 1 ]; then
+  set -- --cert "$BENCH_DIR/cert.pem" --key "$BENCH_DIR/key.pem"
+else
+  set --
+fi
+python3 "$BENCH_SCRIPTS/upload_sink.py" \
+    --port "$BENCH_PORT" \
+    --latency "$BENCH_LATENCY" \
+    --bandwidth "$BENCH_BANDWIDTH" \
+    --error-rate "$BENCH_ERROR_RATE" \
+    "$@" > "$BENCH_DIR/sink.log" &
+SINK=$!
+DAEMON_PID=
+trap 'kill $SINK $DAEMON_PID 2>/dev/null' EXIT
+sleep 1
+
+# make_files <directory> <count> <size>
+make_files() {
+  mkdir -p "$1"
+  python3 -c '
+import os, sys
+directory, count, size = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+data = os.urandom(size)
+for idx in range(count):
+  with open(os.path.join(directory, "f%06d" % idx), "wb") as handle:
+    handle.write(data)
+' "$1" "$2" "$3"
+}
+
+now() {
+  date +%s.%N
+}
+
+# Lay out a workload's files in STAGING and the directories the daemon
+# should find at startup in UPLOADS. Print the number of files and bytes.
+prepare() {
+  case "$1" in
+    small)
+      burst=0
+      remaining=$SMALL_FILES
+      while [ "$remaining" -gt 0 ]; do
+        count=$((remaining < SMALL_BURST ? remaining : SMALL_BURST))
+        make_files "$STAGING/$burst" "$count" "$SMALL_SIZE"
+        remaining=$((remaining - count))
+        burst=$((burst + 1))
+      done
+      for directory in $(seq "$SMALL_DIRECTORIES"); do
+        mkdir -p "$UPLOADS/small$directory"
+      done
+      echo "$SMALL_FILES $((SMALL_FILES * SMALL_SIZE))"
+      ;;
+    large)
+      make_files "$STAGING" "$LARGE_FILES" "$LARGE_SIZE"
+      mkdir -p "$UPLOADS/large"
+      echo "$LARGE_FILES $((LARGE_FILES * LARGE_SIZE))"
+      ;;
+    dirs)
+      for directory in $(seq "$NEW_DIRECTORIES"); do
+        make_files "$STAGING/dir$directory" "$DIRECTORY_FILES" "$SMALL_SIZE"
+      done
+      files=$((NEW_DIRECTORIES * DIRECTORY_FILES))
+      echo "$files $((files * SMALL_SIZE))"
+      ;;
+    *)
+      echo "Unknown workload $1" >&2
+      exit 1
+      ;;
+  esac
+}
+
+# Move a prepared workload into UPLOADS the way producers would.
+deliver() {
+  case "$1" in
+    small)
+      for burst in $(ls "$STAGING"); do
+        directory=$((burst % SMALL_DIRECTORIES + 1))
+        mv "$STAGING/$burst"/* "$UPLOADS/small$directory/"
+        sleep "$BURST_INTERVAL"
+      done
+      ;;
+    large)
+      mv "$STAGING"/* "$UPLOADS/large/"
+      ;;
+    dirs)
+      for directory in $(ls "$STAGING"); do
+        mv "$STAGING/$directory" "$UPLOADS/"
+      done
+      ;;
+  esac
+}
+
+# Wait until every file has been uploaded and deleted.
+drain() {
+  deadline=$(($(date +%s) + BENCH_TIMEOUT))
+  while [ -n "$(find "$UPLOADS" -type f | head -n 1)" ]; do
+    if [ "$(date +%s)" -ge "$deadline" ]; then
+      echo "Timed out; $(find "$UPLOADS" -type f | wc -l) files left" >&2
+      return 1
+    fi
+    sleep 0.05
+  done
+}
+
+sum_metric() {
+  awk -v name="bismark_data_transmit_$1" \
+      '$1 ~ "^" name "({|$)" { total += $2 } END { print total + 0 }' \
+      "$BENCH_DIR/metrics.prom"
+}
+
+CLOCK_TICKS=$(getconf CLK_TCK)
+printf '%-6s %7s %11s %8s %9s %9s %8s %9s %7s\n' \
+    workload files bytes seconds files/s MB/s cpu_s peak_kB retries
+for workload in $BENCH_WORKLOADS; do
+  rm -rf "$UPLOADS" "$STAGING" "$BENCH_DIR/journal"
+  mkdir -p "$UPLOADS" "$STAGING"
+  set -- $(prepare "$workload")
+  files=$1
+  bytes=$2
+
+  "$DAEMON" "$SCHEME://127.0.0.1:$BENCH_PORT/upload/" \
+      2>> "$BENCH_DIR/daemon.log" &
+  DAEMON_PID=$!
+  sleep 0.5
+
+  started=$(now)
+  deliver "$workload"
+  if ! drain; then
+    kill "$DAEMON_PID"
+    exit 1
+  fi
+  finished=$(now)
+
+  # utime and stime are the 14th and 15th fields, counting from after the
+  # parenthesized command name.
+  cpu=$(sed 's/.*) //' "/proc/$DAEMON_PID/stat" \
+        | awk -v ticks="$CLOCK_TICKS" '{ print ($12 + $13) / ticks }')
+  peak_rss=$(awk '/^VmHWM:/ { print $2 }' "/proc/$DAEMON_PID/status")
+  kill -TERM "$DAEMON_PID"
+  wait "$DAEMON_PID" || true
+  DAEMON_PID=
+
+  uploaded=$(sum_metric files_uploaded_total)
+  if [ "$uploaded" -ne "$files" ]; then
+    echo "$workload: expected $files uploads, the daemon counted $uploaded" >&2
+  fi
+  awk -v workload="$workload" -v files="$files" -v bytes="$bytes" \
+      -v started="$started" -v finished="$finished" -v cpu="$cpu" \
+      -v peak_rss="$peak_rss" -v retries="$(sum_metric files_failed_total)" '
+    BEGIN {
+      seconds = finished - started
+      printf "%-6s %7d %11d %8.2f %9.1f %9.2f %8.2f %9d %7d\n",
+             workload, files, bytes, seconds, files / seconds,
+             bytes / seconds / 1048576, cpu, peak_rss, retries
+    }'
+done
@@ -0,0 +1,205 @@
+/**
+ *
+ * Times the upload_list operations the daemon leans on as its backlog grows,
+ * for backlogs of increasing size. Each size runs these passes over a fresh
+ * list:
+ *
+ *   index   add every file and schedule its first attempt, as the startup
+ *           scan does
+ *   find    look every file up by name, as inotify events do
+ *   retry   take every scheduled file off the schedule, mark it pending,
+ *           then fail it and schedule it again, as retry_uploads() and
+ *           handle_upload_done() do when the server is down
+ *   evict   evict the next victim until half the bytes are gone, as
+ *           enforce_quota() does
+ *   remove  forget the remaining files by name, as successful uploads do
+ *
+ * The report gives nanoseconds per file for each pass, and the memory the
+ * list holds once fully indexed, to help size MAX_UPLOADS_BYTES: divide the
+ * quota by the typical file size and multiply by bytes per entry.
+ *
+ * Usage: upload_list_benchmark [entries...]
+ *
+ **/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "upload_list.h"
+
+#define NUM_DIRECTORIES  8
+#define FIRST_ATTEMPT_WINDOW  180
+
+static const int default_sizes[] = { 1000, 10000, 100000, 1000000 };
+
+static double seconds_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void make_filename(int number, char* filename) {
+  snprintf(filename,
+           PATH_MAX,
+           "/tmp/bismark-uploads/directory%d/%010d-%08lx.gz",
+           number % NUM_DIRECTORIES,
+           number,
+           (unsigned long)(number * 2654435761u));
+}
+
+/* Bytes of heap memory the list's arrays take up. */
+static size_t list_footprint(const upload_list_t* list) {
+  size_t bytes = list->capacity * sizeof(upload_entry_t)
+      + list->names_capacity
+      + list->num_buckets * sizeof(int)
+      + list->schedule.capacity * sizeof(int)
+      + list->num_indices * sizeof(upload_index_t);
+  int idx;
+  for (idx = 0; idx < list->num_indices; ++idx) {
+    bytes += list->indices[idx].evictions.capacity * sizeof(int);
+  }
+  return bytes;
+}
+
+static int run(int num_entries) {
+  upload_list_t list;
+  if (upload_list_init(&list)) {
+    return -1;
+  }
+  char filename[PATH_MAX];
+  time_t current_time = 1000000;
+  double timings[5];
+  int idx;
+
+  double started = seconds_now();
+  for (idx = 0; idx < num_entries; ++idx) {
+    make_filename(idx, filename);
+    upload_entry_t* entry = upload_list_update(
+        &list,
+        filename,
+        current_time - random() % 86400,
+        512 + random() % 65536,
+        idx % NUM_DIRECTORIES);
+    if (entry == NULL) {
+      return -1;
+    }
+    entry->priority = idx % NUM_DIRECTORIES % 3;
+    if (upload_list_schedule(&list,
+                             entry,
+                             current_time + random() % FIRST_ATTEMPT_WINDOW)) {
+      return -1;
+    }
+  }
+  timings[0] = seconds_now() - started;
+  size_t footprint = list_footprint(&list);
+
+  started = seconds_now();
+  int found = 0;
+  for (idx = 0; idx < num_entries; ++idx) {
+    make_filename(idx, filename);
+    found += upload_list_find(&list, filename) != NULL;
+  }
+  timings[1] = seconds_now() - started;
+  if (found != num_entries) {
+    fprintf(stderr, "Only found %d of %d entries\n", found, num_entries);
+    return -1;
+  }
+
+  started = seconds_now();
+  current_time += FIRST_ATTEMPT_WINDOW;
+  upload_entry_t* entry;
+  while ((entry = upload_list_next_scheduled(&list))
+         && entry->next_attempt <= current_time) {
+    upload_list_unschedule(&list, entry);
+    if (upload_list_set_pending(&list, entry, 1)
+        || upload_list_set_pending(&list, entry, 0)
+        || upload_list_schedule(&list,
+                                entry,
+                                current_time + 1 + random() % 360)) {
+      return -1;
+    }
+    ++entry->attempts;
+  }
+  timings[2] = seconds_now() - started;
+
+  started = seconds_now();
+  size_t target = list.total_size / 2;
+  int evicted = 0;
+  while (list.total_size > target
+         && (entry = upload_list_next_eviction(&list, -1))) {
+    upload_list_remove(&list, entry);
+    ++evicted;
+  }
+  timings[3] = seconds_now() - started;
+
+  started = seconds_now();
+  int remaining = list.length;
+  for (idx = 0; idx < num_entries; ++idx) {
+    make_filename(idx, filename);
+    entry = upload_list_find(&list, filename);
+    if (entry != NULL) {
+      upload_list_remove(&list, entry);
+    }
+  }
+  timings[4] = seconds_now() - started;
+  if (list.length != 0) {
+    fprintf(stderr, "%d entries left behind\n", list.length);
+    return -1;
+  }
+
+  /* Eviction and removal only touch some of the files; report their cost
+   * per file they handled. */
+  printf("%9d %9.0f %9.0f %9.0f %9.0f %9.0f %10.2f %9.1f\n",
+         num_entries,
+         timings[0] * 1e9 / num_entries,
+         timings[1] * 1e9 / num_entries,
+         timings[2] * 1e9 / num_entries,
+         evicted > 0 ? timings[3] * 1e9 / evicted : 0,
+         remaining > 0 ? timings[4] * 1e9 / remaining : 0,
+         footprint / 1048576.0,
+         (double)footprint / num_entries);
+  upload_list_destroy(&list);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  srandom(1);
+  printf("%9s %9s %9s %9s %9s %9s %10s %9s\n",
+         "entries",
+         "index_ns",
+         "find_ns",
+         "retry_ns",
+         "evict_ns",
+         "remove_ns",
+         "memory_MB",
+         "B/entry");
+  int idx;
+  if (argc > 1) {
+    for (idx = 1; idx < argc; ++idx) {
+      int num_entries = atoi(argv[idx]);
+      if (num_entries <= 0) {
+        fprintf(stderr, "Invalid number of entries: %s\n", argv[idx]);
+        return 1;
+      }
+      if (run(num_entries)) {
+        return 1;
+      }
+    }
+  } else {
+    for (idx = 0;
+         idx < (int)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+         ++idx) {
+      if (run(default_sizes[idx])) {
+        return 1;
+      }
+    }
+  }
+  struct rusage usage;
+  if (!getrusage(RUSAGE_SELF, &usage)) {
+    printf("Peak RSS: %ld kB\n", usage.ru_maxrss);
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""A stand-in for the uploads server, for benchmarking bismark-data-transmit.
+
+Accepts PUTs on any path and discards their bodies. The link to it can be
+made slow or unreliable:
+
+  --latency SECONDS     delay before every response
+  --bandwidth BYTES     cap on the combined upload rate, in bytes per second
+  --error-rate FRACTION share of requests answered with 500
+  --cert FILE --key FILE
+                        serve HTTPS instead of HTTP
+
+Prints one line per request to stdout: the status, body length, and the
+seconds spent receiving the body.
+"""
+
+import argparse
+import http.server
+import random
+import ssl
+import sys
+import threading
+import time
+
+READ_SIZE = 65536
+
+
+class Throttle(object):
+  """A token bucket shared by every connection, holding at most one second's
+  worth of bytes."""
+
+  def __init__(self, rate):
+    self.rate = rate
+    self.tokens = rate
+    self.updated = time.monotonic()
+    self.lock = threading.Lock()
+
+  def take(self, count):
+    if self.rate <= 0:
+      return
+    with self.lock:
+      now = time.monotonic()
+      self.tokens = min(self.rate,
+                        self.tokens + (now - self.updated) * self.rate)
+      self.updated = now
+      self.tokens -= count
+      wait = -self.tokens / self.rate if self.tokens < 0 else 0
+    if wait > 0:
+      time.sleep(wait)
+
+
+class SinkHandler(http.server.BaseHTTPRequestHandler):
+  protocol_version = 'HTTP/1.1'
+
+  def read_body(self):
+    """Read and discard the body, plain or chunked. Return its length."""
+    throttle = self.server.throttle
+    length = 0
+    if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+      while True:
+        size = int(self.rfile.readline().split(b';')[0].strip(), 16)
+        if size == 0:
+          while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+            pass
+          return length
+        length += self.read_exactly(size, throttle)
+        self.rfile.readline()
+    return self.read_exactly(int(self.headers.get('Content-Length', 0)),
+                             throttle)
+
+  def read_exactly(self, size, throttle):
+    remaining = size
+    while remaining > 0:
+      data = self.rfile.read(min(remaining, READ_SIZE))
+      if not data:
+        break
+      throttle.take(len(data))
+      remaining -= len(data)
+    return size - remaining
+
+  def do_PUT(self):
+    # http.server has already answered any Expect: 100-continue.
+    started = time.monotonic()
+    length = self.read_body()
+    elapsed = time.monotonic() - started
+    if self.server.latency > 0:
+      time.sleep(self.server.latency)
+    status = 500 if random.random() < self.server.error_rate else 200
+    self.send_response(status)
+    self.send_header('Content-Length', '0')
+    self.end_headers()
+    with self.server.output_lock:
+      sys.stdout.write('%d %d %.6f\n' % (status, length, elapsed))
+      sys.stdout.flush()
+
+  def log_message(self, format, *args):
+    pass
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument('--port', type=int, default=18080)
+  parser.add_argument('--latency', type=float, default=0)
+  parser.add_argument('--bandwidth', type=int, default=0)
+  parser.add_argument('--error-rate', type=float, default=0)
+  parser.add_argument('--cert')
+  parser.add_argument('--key')
+  args = parser.parse_args()
+
+  server = http.server.ThreadingHTTPServer(('127.0.0.1', args.port),
+                                           SinkHandler)
+  server.daemon_threads = True
+  server.latency = args.latency
+  server.error_rate = args.error_rate
+  server.throttle = Throttle(args.bandwidth)
+  server.output_lock = threading.Lock()
+  if args.cert:
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(args.cert, args.key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+  server.serve_forever()
+
+
+if __name__ == '__main__':
+  main()
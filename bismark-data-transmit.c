@@ -9,9 +9,16 @@
  *    files moved into these directories are detected, not new files created
  *    with the directories.)
  * 2. For each file, attempt to upload the file to a server using HTTPS PUT via
- *    libcurl.
- * 3. If an upload fails (e.g., it times out), then retry the upload every 3
- *    minutes until is succeeds.
+ *    libcurl. Up to MAX_CONCURRENT_UPLOADS transfers run at once, driven by
+ *    the same epoll loop that watches for new files, whose timers and
+ *    signals arrive through a timerfd and a signalfd. Directories
+ *    configured with batch=1 coalesce small files into one tar upload, and
+ *    ones with compress=gzip (or zstd) compress uploads as they stream.
+ * 3. If an upload fails (e.g., it times out), then retry the upload after 3
+ *    minutes, doubling the delay (with random jitter) after every further
+ *    failure up to MAX_RETRY_INTERVAL_MINUTES. If several uploads in a row
+ *    can't reach the server, stop uploading altogether and later probe it
+ *    with a single upload before resuming.
  * 4. If an upload still hasn't succeeded after an hour, permanently delete
  *    the file.
  *
@@ -20,19 +27,34 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
 
+#include "backoff.h"
+#include "debounce_queue.h"
+#include "directory_config.h"
+#include "monotonic.h"
+#include "upload_batch.h"
+#include "upload_engine.h"
+#include "upload_journal.h"
 #include "upload_list.h"
+#include "upload_metrics.h"
+#include "upload_scan.h"
+#include "watch_table.h"
 
 #ifndef BISMARK_ID_FILENAME
 #define BISMARK_ID_FILENAME  "/etc/bismark/ID"
@@ -45,54 +67,166 @@
 #define RETRY_INTERVAL_MINUTES  3
 #endif
 #define RETRY_INTERVAL_SECONDS  (RETRY_INTERVAL_MINUTES * 60)
+#ifndef MAX_RETRY_INTERVAL_MINUTES
+#define MAX_RETRY_INTERVAL_MINUTES  48
+#endif
+#define MAX_RETRY_INTERVAL_SECONDS  (MAX_RETRY_INTERVAL_MINUTES * 60)
+#ifndef CIRCUIT_BREAKER_THRESHOLD
+#define CIRCUIT_BREAKER_THRESHOLD  5
+#endif
 #ifndef DEFAULT_UPLOADS_URL
 #define DEFAULT_UPLOADS_URL  "https://uploads.projectbismark.net:8081/upload/"
 #endif
-#ifndef MAX_UPLOADS_BLOCKS
-#define MAX_UPLOADS_BLOCKS  6144
+/* Pending uploads live in RAM-backed /tmp, so the quota counts file bytes
+ * rather than allocated blocks. MAX_UPLOADS_BLOCKS is still honored for old
+ * build scripts. */
+#ifndef MAX_UPLOADS_BYTES
+#ifdef MAX_UPLOADS_BLOCKS
+#define MAX_UPLOADS_BYTES  ((size_t)(MAX_UPLOADS_BLOCKS) * 512)
+#else
+#define MAX_UPLOADS_BYTES  (5 * 1024 * 1024)
+#endif
+#endif
+#ifndef MAX_CONCURRENT_UPLOADS
+#define MAX_CONCURRENT_UPLOADS  4
 #endif
-#ifndef TRANSFER_TIMEOUT_SECONDS
-#define TRANSFER_TIMEOUT_SECONDS 300
+/* Where the upload journal lives. /tmp survives restarts of the daemon,
+ * though not reboots, which is all the uploads themselves survive too. */
+#ifndef JOURNAL_FILENAME
+#define JOURNAL_FILENAME  "/tmp/bismark-data-transmit.journal"
 #endif
-#ifndef CONNECT_TIMEOUT_SECONDS
-#define CONNECT_TIMEOUT_SECONDS 300
+/* Rewrite the journal from a snapshot once it holds this many records, and
+ * more than four per pending upload. */
+#ifndef JOURNAL_COMPACT_RECORDS
+#define JOURNAL_COMPACT_RECORDS  4096
+#endif
+/* How long a file written in place in an on_close directory must go without
+ * being closed again before it's uploaded. */
+#ifndef CLOSE_WRITE_DEBOUNCE_MILLISECONDS
+#define CLOSE_WRITE_DEBOUNCE_MILLISECONDS  100
+#endif
+#ifndef CONFIG_FILENAME
+#define CONFIG_FILENAME  "/etc/config/bismark-data-transmit"
 #endif
 #ifndef FAILURES_LOG
 #define FAILURES_LOG  "/tmp/bismark-data-transmit-failures.log"
 #endif
-#ifndef BUILD_ID
-#define BUILD_ID  "git"
+/* Counters and latency histograms are rewritten here for monitoring to
+ * scrape, e.g. with node_exporter's textfile collector. */
+#ifndef METRICS_FILENAME
+#define METRICS_FILENAME  "/tmp/bismark-data-transmit.prom"
+#endif
+#ifndef METRICS_INTERVAL_SECONDS
+#define METRICS_INTERVAL_SECONDS  60
 #endif
 #define MAX_URL_LENGTH  2000
-#define BUF_LEN  (sizeof(struct inotify_event) * 10)
+/* Room for hundreds of events with long names per read(). */
+#ifndef INOTIFY_BUFFER_SIZE
+#define INOTIFY_BUFFER_SIZE  65536
+#endif
+#define MAX_EPOLL_EVENTS  16
+/* How many files the startup scan indexes between turns of the main loop. */
+#ifndef SCAN_BATCH_FILES
+#define SCAN_BATCH_FILES  128
+#endif
 
 /* Will be filled in with this node's Bismark ID. */
-static char bismark_id[BISMARK_ID_LEN];
+static char bismark_id[BISMARK_ID_LEN + 1];
 
 /* Will be filled in with the URL to post uploads. */
 static char uploads_url[MAX_URL_LENGTH];
 
 /* A dynamically allocated list of directories to monitor for files to upload.
- * These are directory names relative to UPLOADS_ROOT. */
+ * These are directory names relative to UPLOADS_ROOT. Directories are added
+ * as they appear in UPLOADS_ROOT. One that disappears keeps its index, with
+ * no watch descriptor, and gets it back if it returns. */
 static const char** upload_subdirectories = NULL;
 static int num_upload_subdirectories = 0;
+/* Allocated length of upload_subdirectories and the arrays indexed like it. */
+static int upload_directories_capacity = 0;
 
 /* This gets populated with the absolute paths of the upload directories we
  * monitor, whose relative paths are specified in upload_subdirectories. */
 static const char** upload_directories;
 
 /* This gets populated with the inotify watch descriptors corresponding
- * to the directories in upload_directories. */
+ * to the directories in upload_directories, or -1 for directories that
+ * are gone. */
 static int* watch_descriptors;
 
+/* Open fds of the watched upload directories, indexed like
+ * upload_directories, or -1. Files are stat()ed and deleted relative to
+ * them, which spares the kernel walking UPLOADS_ROOT for every file. */
+static int* directory_fds;
+
+/* The inotify instance, and its watch on UPLOADS_ROOT itself. */
+static int inotify_handle = -1;
+static int root_watch_descriptor = -1;
+
+/* Maps watch descriptors back to indices into upload_directories. */
+static watch_table_t watch_table;
+
 /* This gets populated with counters of failed uploads. The length and indices
  * will match those of upload_directories. */
 static int* failure_counters;
 
-static CURL* curl_handle;
+/* Per-directory settings from CONFIG_FILENAME, indexed like
+ * upload_directories. */
+static directory_config_t* directory_configs;
+
+/* Open batches of small files, indexed like upload_directories. Only used
+ * for directories with batching enabled. */
+static upload_batch_t* batches;
+
+/* Upload counters and histograms, indexed like upload_directories. */
+static upload_metrics_t* directory_metrics;
 
-/* cURL's error buffer. Any time cURL has an error, it writes it here. */
-static const char curl_error_message[CURL_ERROR_SIZE];
+/* When METRICS_FILENAME is next rewritten, on the monotonic clock. */
+static time_t metrics_deadline;
+
+/* Directory modification times recorded by the last clean shutdown, indexed
+ * like upload_directories. tv_sec is -1 if unknown. A directory whose mtime
+ * hasn't changed since holds exactly the files the journal says it does, so
+ * it needn't be scanned at startup. */
+static struct timespec* directory_mtimes;
+
+/* Every file waiting in an upload directory, including ones being uploaded.
+ * It's filled by one scan at startup and then kept up to date from inotify
+ * events, so retries and quota enforcement never walk the directories. */
+static upload_list_t pending_uploads;
+
+/* Stops uploads while the server is unreachable. */
+static circuit_breaker_t circuit_breaker;
+
+/* Runs the uploads concurrently on top of a cURL multi handle. */
+static upload_engine_t upload_engine;
+
+/* Set once the main loop has exited. Files found after that are indexed for
+ * the journal but not uploaded, since the engine is about to be torn
+ * down. */
+static int shutting_down;
+
+/* Files closed in on_close directories, waiting out their debounce. */
+static debounce_queue_t closed_uploads;
+
+/* Remembers pending uploads, their attempts and the failure counters across
+ * restarts. */
+static upload_journal_t journal;
+
+/* Directories whose startup scan is still running, in the order they are
+ * scanned, and the scan of the first one. The main loop indexes a batch of
+ * files at a time, so uploads start before a large backlog is fully
+ * indexed. */
+static int* deferred_scans;
+static int num_deferred_scans;
+static int deferred_scans_capacity;
+static int next_deferred_scan;
+static upload_scan_t deferred_scan;
+
+/* How often the kernel's inotify queue overflowed and lost events, and how
+ * many files the rescans that followed turned up. */
+static unsigned long inotify_overflows;
+static unsigned long overflow_files_recovered;
 
 /* Concatenate two paths. They will be separated with a '/'. result must be at
  * least PATH_MAX bytes long. Return 0 if successful and -1 otherwise. */
@@ -105,175 +239,375 @@ static int join_paths(const char* first, const char* second, char* result) {
   }
 }
 
-/* Build the upload_subdirectories array
- * by scanning UPLOADS_ROOT for subdirectories. */
-static int initialize_upload_subdirectories() {
-  DIR* handle = opendir(UPLOADS_ROOT);
-  if (handle == NULL) {
-    syslog(LOG_ERR,
-           "initialize_upload_subdirectories:opendir(\"%s\"): %s",
-           UPLOADS_ROOT,
-           strerror(errno));
-    return -1;
-  }
-  struct dirent* entry;
-  while ((entry = readdir(handle))) {
-    if (entry->d_name[0] == '.') {  /* Skip hidden, ".", and ".." */
-      continue;
-    }
-    char absolute_filename[PATH_MAX + 1];
-    if (join_paths(UPLOADS_ROOT, entry->d_name, absolute_filename)) {
-      return -1;
-    }
-    struct stat dir_info;
-    if (stat(absolute_filename, &dir_info)) {
-      syslog(LOG_ERR,
-             "initialize_upload_subdirectories:stat(\"%s\"): %s",
-             absolute_filename,
-             strerror(errno));
-      return -1;
-    }
-    if (S_ISDIR(dir_info.st_mode)) {
-      ++num_upload_subdirectories;
-      upload_subdirectories = realloc(
-          upload_subdirectories,
-          num_upload_subdirectories * sizeof(upload_subdirectories[0]));
-      if (upload_subdirectories == NULL) {
-        syslog(LOG_ERR,
-               "initialize_upload_subdirectories:realloc: %s",
-               strerror(errno));
-        return -1;
-      }
-      upload_subdirectories[num_upload_subdirectories - 1]
-          = strdup(entry->d_name);
+/* Append a record about an entry to the journal. */
+static void journal_entry(upload_journal_type_t type,
+                          const upload_entry_t* entry) {
+  time_t current_time = monotonic_seconds();
+  upload_journal_record_t record;
+  record.type = type;
+  record.time = 0;
+  record.value = 0;
+  record.name = upload_list_filename(&pending_uploads, entry);
+  if (type == UPLOAD_JOURNAL_ADD) {
+    record.time = entry->last_modified;
+    record.value = entry->size;
+  } else if (type == UPLOAD_JOURNAL_FAIL) {
+    /* The schedule is on the monotonic clock, which restarts with the
+     * machine, so store the next attempt on the wall clock. */
+    record.time = time(NULL);
+    if (entry->heap_position >= 0 && entry->next_attempt > current_time) {
+      record.time += entry->next_attempt - current_time;
     }
+    record.value = entry->attempts;
   }
-  (void)closedir(handle);
-  return 0;
+  (void)upload_journal_append(&journal, &record, current_time);
+}
+
+/* Forget an entry for good. */
+static void remove_upload(upload_entry_t* entry) {
+  journal_entry(UPLOAD_JOURNAL_REMOVE, entry);
+  upload_list_remove(&pending_uploads, entry);
+}
+
+/* Schedule a new entry's first attempt, RETRY_INTERVAL_SECONDS (jittered)
+ * after the file last changed. */
+static void schedule_first_attempt(upload_entry_t* entry) {
+  /* File times are on the wall clock but the schedule isn't, so carry
+   * over how long ago the file changed. */
+  time_t age = time(NULL) - entry->last_modified;
+  time_t delay = backoff_jitter(RETRY_INTERVAL_SECONDS) - (age > 0 ? age : 0);
+  upload_list_schedule(&pending_uploads,
+                       entry,
+                       monotonic_seconds() + (delay > 0 ? delay : 0));
+}
+
+/* Record a file in pending_uploads given its status, or refresh its entry,
+ * and schedule new entries for their first retry, RETRY_INTERVAL_SECONDS
+ * (jittered) after the file last changed. Return the entry, or NULL if the
+ * file isn't a regular file. */
+static upload_entry_t* index_file(int index,
+                                  const char* absolute_path,
+                                  const struct stat* file_info) {
+  if (!S_ISREG(file_info->st_mode)) {
+    return NULL;
+  }
+  const upload_entry_t* existing
+      = upload_list_find(&pending_uploads, absolute_path);
+  int changed = existing == NULL
+      || existing->last_modified != file_info->st_ctime
+      || existing->size != (size_t)file_info->st_size;
+  upload_entry_t* entry = upload_list_update(&pending_uploads,
+                                             absolute_path,
+                                             file_info->st_ctime,
+                                             file_info->st_size,
+                                             index);
+  if (entry == NULL) {
+    return NULL;
+  }
+  if (changed) {
+    journal_entry(UPLOAD_JOURNAL_ADD, entry);
+  }
+  entry->priority = directory_configs[index].priority;
+  if (!entry->pending && entry->heap_position < 0) {
+    schedule_first_attempt(entry);
+  }
+  return entry;
 }
 
-/* Build the upload_directories array by converting upload_subdirectories to
- * absolute path names. The generated paths don't have a trailing slash. */
-static int initialize_upload_directories() {
-  upload_directories = calloc(num_upload_subdirectories,
-                              sizeof(upload_directories[0]));
-  if (upload_directories == NULL) {
+/* Like index_file(), for a file called name in a watched upload directory
+ * that hasn't been stat()ed yet. Return NULL if it can't be. */
+static upload_entry_t* index_upload(int index,
+                                    const char* name,
+                                    const char* absolute_path) {
+  struct stat file_info;
+  if (fstatat(directory_fds[index], name, &file_info, 0)) {
     syslog(LOG_ERR,
-           "initialize_upload_directories:calloc: %s",
+           "index_upload:fstatat(\"%s\"): %s",
+           absolute_path,
            strerror(errno));
+    return NULL;
+  }
+  return index_file(index, absolute_path, &file_info);
+}
+
+/* Delete a file from an upload directory, relative to the directory's fd
+ * while it is watched. */
+static int unlink_upload(int index, const char* absolute_path) {
+  const char* slash = strrchr(absolute_path, '/');
+  if (directory_fds[index] < 0 || slash == NULL) {
+    return unlink(absolute_path);
+  }
+  return unlinkat(directory_fds[index], slash + 1, 0);
+}
+
+/* Return 1 if a member's name now refers to a different file than the one
+ * that was uploaded, which must not be deleted in its place. Links are
+ * followed, as they were when the member was opened. */
+static int upload_replaced(int index, const upload_member_t* member) {
+  const char* slash = strrchr(member->filename, '/');
+  struct stat file_info;
+  int result = directory_fds[index] < 0 || slash == NULL
+      ? stat(member->filename, &file_info)
+      : fstatat(directory_fds[index], slash + 1, &file_info, 0);
+  return !result
+      && (file_info.st_dev != member->device
+          || file_info.st_ino != member->inode);
+}
+
+static void forget_upload(const char* absolute_path) {
+  upload_entry_t* entry = upload_list_find(&pending_uploads, absolute_path);
+  if (entry != NULL) {
+    remove_upload(entry);
+  }
+}
+
+/* Add the files already sitting in an upload directory to pending_uploads. */
+static int scan_upload_directory(int index) {
+  upload_scan_t scan;
+  if (upload_scan_open(&scan, upload_directories[index])) {
     return -1;
   }
-  int idx;
-  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+  const char* name;
+  struct stat file_info;
+  int result;
+  while ((result = upload_scan_next(&scan, &name, &file_info)) > 0) {
     char absolute_path[PATH_MAX + 1];
-    if (join_paths(UPLOADS_ROOT, upload_subdirectories[idx], absolute_path)) {
-      return -1;
+    if (!join_paths(upload_directories[index], name, absolute_path)) {
+      (void)index_file(index, absolute_path, &file_info);
     }
-    upload_directories[idx] = strdup(absolute_path);
-    if (upload_directories[idx] == NULL) {
-      syslog(LOG_ERR,
-             "upload_directories:strdup(\"%s\"): %s",
-             absolute_path,
-             strerror(errno));
+  }
+  upload_scan_close(&scan);
+  return result;
+}
+
+/* Queue a directory for the incremental startup scan. */
+static int defer_scan(int index) {
+  if (num_deferred_scans == deferred_scans_capacity) {
+    int capacity = deferred_scans_capacity > 0
+        ? 2 * deferred_scans_capacity
+        : 8;
+    int* scans = realloc(deferred_scans, capacity * sizeof(scans[0]));
+    if (scans == NULL) {
+      syslog(LOG_ERR, "defer_scan:realloc: %s", strerror(errno));
       return -1;
     }
+    deferred_scans = scans;
+    deferred_scans_capacity = capacity;
   }
+  deferred_scans[num_deferred_scans++] = index;
   return 0;
 }
 
-/* Send a file to the server using cURL. */
-static int curl_send(const char* filename, const char* directory) {
-  /* Open the file we're going to upload and determine its
-   * size. (cURL needs to the know the size.) */
-  FILE* handle = fopen(filename, "rb");
-  if (!handle) {
-    syslog(LOG_ERR, "curl_send:fopen(\"%s\"): %s", filename, strerror(errno));
-    return -1;
+/* Index up to SCAN_BATCH_FILES more files from the deferred scans. A
+ * directory that goes away meanwhile is skipped. Return 1 while there is
+ * more to scan. */
+static int continue_deferred_scans() {
+  int scanned = 0;
+  while (next_deferred_scan < num_deferred_scans
+         && scanned < SCAN_BATCH_FILES) {
+    int index = deferred_scans[next_deferred_scan];
+    if (watch_descriptors[index] >= 0 && deferred_scan.fd < 0
+        && upload_scan_open(&deferred_scan, upload_directories[index])) {
+      ++next_deferred_scan;
+      continue;
+    }
+    const char* name;
+    struct stat file_info;
+    if (watch_descriptors[index] < 0
+        || upload_scan_next(&deferred_scan, &name, &file_info) <= 0) {
+      upload_scan_close(&deferred_scan);
+      ++next_deferred_scan;
+      continue;
+    }
+    char absolute_path[PATH_MAX + 1];
+    if (!join_paths(upload_directories[index], name, absolute_path)) {
+      (void)index_file(index, absolute_path, &file_info);
+    }
+    ++scanned;
   }
-  fseek(handle, 0L, SEEK_END);
-  long file_size = ftell(handle);
-  rewind(handle);
+  if (next_deferred_scan < num_deferred_scans) {
+    return 1;
+  }
+  if (num_deferred_scans > 0) {
+    syslog(LOG_INFO,
+           "Startup scan finished; %d pending uploads",
+           pending_uploads.length);
+    free(deferred_scans);
+    deferred_scans = NULL;
+    num_deferred_scans = 0;
+    deferred_scans_capacity = 0;
+    next_deferred_scan = 0;
+  }
+  return 0;
+}
 
-  /* Build the URL. */
-  char* encoded_filename = curl_easy_escape(curl_handle, filename, 0);
-  if (encoded_filename == NULL) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_escape(\"%s\"): %s\n",
-           filename,
-           curl_error_message);
-    return -1;
+/* Remove successfully uploaded files. Failed uploads stay where they are and
+ * are rescheduled with exponential backoff. */
+/* Put a file whose upload attempt failed back on the schedule, backing off
+ * by its number of attempts. */
+static void schedule_retry(upload_entry_t* entry, time_t current_time) {
+  upload_list_set_pending(&pending_uploads, entry, 0);
+  ++entry->attempts;
+  upload_list_schedule(&pending_uploads,
+                       entry,
+                       current_time + backoff_delay(
+                           entry->attempts,
+                           RETRY_INTERVAL_SECONDS,
+                           MAX_RETRY_INTERVAL_SECONDS));
+  journal_entry(UPLOAD_JOURNAL_FAIL, entry);
+}
+
+static void handle_upload_done(const upload_request_t* request, int succeeded) {
+  time_t current_time = monotonic_seconds();
+  if (succeeded) {
+    circuit_breaker_record(
+        &circuit_breaker, UPLOAD_OUTCOME_SUCCESS, current_time);
+  } else if (upload_request_server_failed(request)) {
+    circuit_breaker_record(
+        &circuit_breaker, UPLOAD_OUTCOME_SERVER_FAILURE, current_time);
+  } else {
+    circuit_breaker_record(
+        &circuit_breaker, UPLOAD_OUTCOME_OTHER_FAILURE, current_time);
   }
-  char* encoded_nodeid = curl_easy_escape(curl_handle, bismark_id, 0);
-  if(encoded_nodeid == NULL) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_escape(\"%s\"): %s\n",
-           bismark_id,
-           curl_error_message);
-    return -1;
+
+  upload_metrics_t* metrics = &directory_metrics[request->index];
+  metrics->bytes_sent += request->bytes_sent;
+  if (request->connect_time >= 0) {
+    upload_histogram_observe(&metrics->connect_time, request->connect_time);
   }
-  char* encoded_buildid = curl_easy_escape(curl_handle, BUILD_ID, 0);
-  if(encoded_buildid == NULL) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_escape(\"%s\"): %s\n",
-           BUILD_ID,
-           curl_error_message);
-    return -1;
+  if (succeeded) {
+    upload_histogram_observe(&metrics->transfer_time, request->total_time);
   }
-  char* encoded_directory = curl_easy_escape(curl_handle, directory, 0);
-  if(encoded_directory == NULL) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_escape(\"%s\"): %s\n",
-           directory,
-           curl_error_message);
-    return -1;
+
+  time_t wall_time = time(NULL);
+  int idx;
+  for (idx = 0; idx < request->num_members; ++idx) {
+    const upload_member_t* member = &request->members[idx];
+    upload_entry_t* entry = upload_list_find(&pending_uploads, member->filename);
+    if (member->size < 0) {
+      /* Never sent. A file that vanished is forgotten; one that couldn't be
+       * opened, say for lack of fds, is retried like a failed upload. */
+      if (entry != NULL) {
+        if (member->error == ENOENT) {
+          remove_upload(entry);
+        } else {
+          schedule_retry(entry, current_time);
+        }
+      }
+      continue;
+    }
+    if (succeeded) {
+      ++metrics->files_uploaded;
+      if (entry != NULL) {
+        upload_histogram_observe(&metrics->latency,
+                                 wall_time - entry->last_modified);
+      }
+    } else {
+      ++metrics->files_failed;
+    }
+    if (succeeded && upload_replaced(request->index, member)) {
+      /* Its inotify event came while it was pending, so nothing has
+       * scheduled the new file yet. The entry already describes it. Wait
+       * a retry interval, in case it keeps being replaced. */
+      syslog(LOG_INFO, "File replaced during upload: %s", member->filename);
+      if (entry != NULL) {
+        upload_list_set_pending(&pending_uploads, entry, 0);
+        upload_list_schedule(
+            &pending_uploads,
+            entry,
+            current_time + backoff_jitter(RETRY_INTERVAL_SECONDS));
+      }
+      continue;
+    }
+    if (!succeeded
+        || (unlink_upload(request->index, member->filename)
+            && errno != ENOENT)) {
+      if (succeeded) {
+        syslog(LOG_ERR,
+               "handle_upload_done:unlink(\"%s\"): %s",
+               member->filename,
+               strerror(errno));
+      }
+      if (entry != NULL) {
+        schedule_retry(entry, current_time);
+      }
+      continue;
+    }
+    if (entry != NULL) {
+      remove_upload(entry);
+    }
   }
-  char url[MAX_URL_LENGTH];
-  snprintf(url,
-           sizeof(url),
-           "%s?filename=%s&node_id=%s&build_id=%s&directory=%s",
-           uploads_url,
-           encoded_filename,
-           encoded_nodeid,
-           encoded_buildid,
-           encoded_directory);
-  curl_free(encoded_filename);
-  curl_free(encoded_nodeid);
-  curl_free(encoded_buildid);
-  curl_free(encoded_directory);
-
-  /* Set up and execute the transfer. */
-  if (curl_easy_setopt(curl_handle, CURLOPT_URL, url)) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_URL, \"%s\"): %s",
-           url,
-           curl_error_message);
-    return -1;
+}
+
+/* Hand a directory's open batch, if any, to the upload engine. */
+static void flush_batch(int index) {
+  upload_request_t* request = upload_batch_take(&batches[index]);
+  if (request != NULL) {
+    request->encoding = directory_configs[index].encoding;
+    request->priority = directory_configs[index].priority;
+    upload_engine_enqueue(&upload_engine, request);
   }
-  if (curl_easy_setopt(curl_handle, CURLOPT_READDATA, handle)) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_READDATA): %s",
-           curl_error_message);
-    return -1;
+}
+
+/* Flush every batch whose window has closed, or every batch if force is
+ * set. */
+static void flush_batches(time_t current_time, int force) {
+  int idx;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    time_t deadline = upload_batch_deadline(&batches[idx]);
+    if (deadline >= 0 && (force || deadline <= current_time)) {
+      flush_batch(idx);
+    }
   }
-  if (curl_easy_setopt(curl_handle, CURLOPT_SSLVERSION, CURL_SSLVERSION_SSLv3)) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_SSLVERSION): %s",
-           curl_error_message);
+}
+
+/* Start uploading an indexed file, through its directory's batch if it has
+ * one and the file is small enough. entry may be invalid afterwards. Return
+ * -1 if the daemon is shutting down or the circuit breaker held the upload
+ * back, in which case the file stays scheduled as it was, or if the upload couldn't be queued, in which
+ * case the file is scheduled for another attempt after
+ * RETRY_INTERVAL_SECONDS (jittered). */
+static int enqueue_upload(upload_entry_t* entry, time_t current_time) {
+  if (shutting_down || !circuit_breaker_allow(&circuit_breaker, current_time)) {
     return -1;
   }
-  if (curl_easy_setopt(curl_handle, CURLOPT_INFILESIZE, file_size)) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_INFILESIZE, %ld): %s",
-           file_size,
-           curl_error_message);
-    return -1;
+  int index = entry->index;
+  const char* absolute_path = upload_list_filename(&pending_uploads, entry);
+  upload_list_unschedule(&pending_uploads, entry);
+  upload_list_set_pending(&pending_uploads, entry, 1);
+  off_t size = entry->size;
+  int status;
+  if (directory_configs[index].batch
+      && upload_batch_accepts(absolute_path, size)) {
+    status = upload_batch_add(&batches[index],
+                              upload_directories[index],
+                              upload_subdirectories[index],
+                              index,
+                              absolute_path,
+                              size,
+                              current_time);
+    if (status > 0) {
+      flush_batch(index);
+    }
+  } else {
+    status = upload_engine_submit(&upload_engine,
+                                  absolute_path,
+                                  upload_subdirectories[index],
+                                  index,
+                                  directory_configs[index].encoding,
+                                  directory_configs[index].priority);
   }
-  if (curl_easy_perform(curl_handle)) {
-    syslog(LOG_ERR, "curl_send:curl_easy_perform: %s", curl_error_message);
-    fclose(handle);
+  if (status < 0) {
+    /* Nothing reached the server, so a probe proved nothing. */
+    circuit_breaker_record(
+        &circuit_breaker, UPLOAD_OUTCOME_OTHER_FAILURE, current_time);
+    upload_list_set_pending(&pending_uploads, entry, 0);
+    upload_list_schedule(&pending_uploads,
+                         entry,
+                         current_time + backoff_jitter(RETRY_INTERVAL_SECONDS));
     return -1;
   }
-  fclose(handle);
+  ++directory_metrics[index].files_enqueued;
   return 0;
 }
 
@@ -292,6 +626,11 @@ static int write_upload_failures_log() {
   }
   int idx;
   for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    /* Directories that are gone are only listed while they have failures
+     * to report. */
+    if (watch_descriptors[idx] < 0 && failure_counters[idx] == 0) {
+      continue;
+    }
     if (fprintf(handle,
                 "%s %d\n",
                 upload_subdirectories[idx],
@@ -305,163 +644,884 @@ static int write_upload_failures_log() {
   return 0;
 }
 
-static void retry_uploads(time_t current_time) {
-  upload_list_t files_to_sort;
-  upload_list_init(&files_to_sort);
-  int new_upload_failure = 0;
+static int write_metrics() {
+  upload_metrics_totals_t totals;
+  totals.inotify_overflows = inotify_overflows;
+  totals.overflow_files_recovered = overflow_files_recovered;
+  totals.pending_files = pending_uploads.length;
+  totals.pending_bytes = pending_uploads.total_size;
+  totals.active_uploads = upload_engine.num_active;
+  totals.queued_uploads = upload_engine.num_pending;
+  totals.upload_concurrency = link_estimate_concurrency(&upload_engine.link);
+  totals.link_throughput = upload_engine.link.throughput;
+  totals.link_round_trip_time = upload_engine.link.round_trip_time;
+  return upload_metrics_write(METRICS_FILENAME,
+                              &totals,
+                              upload_subdirectories,
+                              directory_metrics,
+                              num_upload_subdirectories);
+}
 
-  syslog(LOG_INFO, "Checking for uploads to retry");
+/* Return 1 if a directory holds more than its own quota allows. */
+static int over_directory_quota(int index) {
+  return directory_configs[index].quota > 0
+      && upload_list_index_size(&pending_uploads, index)
+         > directory_configs[index].quota;
+}
 
-  int idx;
-  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
-    DIR* handle = opendir(upload_directories[idx]);
-    if (handle == NULL) {
+/* Delete the lowest priority, oldest files until the rest fit in
+ * MAX_UPLOADS_BYTES and in their directories' quotas. Files with an upload in
+ * progress are never deleted. Each deletion only looks at the top of the
+ * index's eviction heaps, so this costs nothing while under quota. Return 1
+ * if any files were deleted. */
+static int enforce_quota() {
+  int new_upload_failure = 0;
+  while (1) {
+    upload_entry_t* victim = NULL;
+    int idx;
+    for (idx = 0; idx < num_upload_subdirectories && victim == NULL; ++idx) {
+      if (over_directory_quota(idx)) {
+        victim = upload_list_next_eviction(&pending_uploads, idx);
+      }
+    }
+    if (victim == NULL && pending_uploads.total_size > MAX_UPLOADS_BYTES) {
+      victim = upload_list_next_eviction(&pending_uploads, -1);
+    }
+    if (victim == NULL) {
+      break;
+    }
+
+    const char* filename = upload_list_filename(&pending_uploads, victim);
+    syslog(LOG_INFO, "Removing old upload: %s", filename);
+    if (unlink_upload(victim->index, filename)) {
+      /* Forget the file anyway so it can't be picked again. */
       syslog(LOG_ERR,
-          "retry_uploads:opendir(\"%s\"): %s",
-          upload_directories[idx],
-          strerror(errno));
-      continue;
+             "enforce_quota:unlink(\"%s\"): %s",
+             filename,
+             strerror(errno));
+      remove_upload(victim);
+    } else {
+      log_upload_failure(victim->index);
+      ++directory_metrics[victim->index].files_evicted;
+      new_upload_failure = 1;
+      journal_entry(UPLOAD_JOURNAL_EVICT, victim);
+      upload_list_remove(&pending_uploads, victim);
     }
-    struct dirent* entry;
-    while ((entry = readdir(handle))) {
-      char absolute_path[PATH_MAX + 1];
-      if (join_paths(upload_directories[idx], entry->d_name, absolute_path)) {
-        continue;
-      }
-      struct stat file_info;
-      if (stat(absolute_path, &file_info)) {
-        syslog(LOG_ERR,
-            "retry_uploads:stat(\"%s\"): %s",
-            absolute_path,
-            strerror(errno));
-        continue;
-      }
-      if (S_ISREG(file_info.st_mode) || S_ISLNK(file_info.st_mode)) {
-        if (current_time - file_info.st_ctime > RETRY_INTERVAL_SECONDS) {
-          syslog(LOG_INFO, "Retrying file: %s", absolute_path);
-          if (curl_send(absolute_path, upload_subdirectories[idx]) == 0) {
-            if (unlink(absolute_path)) {
-              syslog(LOG_ERR,
-                  "retry_uploads:unlink(\"%s\"): %s",
-                  absolute_path,
-                  strerror(errno));
-            } else {
-              continue;
-            }
-          }
-        }
+  }
+  return new_upload_failure;
+}
 
-        upload_list_append(&files_to_sort,
-            absolute_path,
-            file_info.st_ctime,
-            file_info.st_blocks,
-            idx);
-      }
+/* Start every upload whose scheduled retry time has come. */
+static void retry_uploads(time_t current_time) {
+  int retried = 0;
+  upload_entry_t* entry;
+  while ((entry = upload_list_next_scheduled(&pending_uploads))
+         && entry->next_attempt <= current_time) {
+    time_t ready_time = circuit_breaker_ready_time(&circuit_breaker);
+    if (ready_time < 0 || ready_time > current_time) {
+      break;
     }
-    if (closedir(handle)) {
-      syslog(LOG_ERR, "retry_uploads:closedir: %s", strerror(errno));
-    }
-  }
-
-  if (files_to_sort.entries != NULL) {
-    upload_list_sort(&files_to_sort);
-    int total_blocks = 0;
-    for (idx = 0; idx < files_to_sort.length; ++idx) {
-      upload_entry_t* entry = &files_to_sort.entries[idx];
-      if (total_blocks + entry->size > MAX_UPLOADS_BLOCKS) {
-        syslog(LOG_INFO,
-               "Removing old upload: %s",
-               files_to_sort.entries[idx].filename);
-        if (unlink(files_to_sort.entries[idx].filename)) {
-          syslog(LOG_ERR,
-                 "retry_uploads:unlink(\"%s\"): %s",
-                 files_to_sort.entries[idx].filename,
-                 strerror(errno));
-        } else {
-          log_upload_failure(files_to_sort.entries[idx].index);
-          new_upload_failure = 1;
-        }
-      } else {
-        total_blocks += entry->size;
-      }
+    syslog(LOG_INFO,
+           "Retrying file: %s",
+           upload_list_filename(&pending_uploads, entry));
+    if (enqueue_upload(entry, current_time)) {
+      break;
     }
+    retried = 1;
+  }
+
+  /* Don't hold retried files back waiting for more to arrive. */
+  if (retried) {
+    flush_batches(current_time, 1);
   }
-  upload_list_destroy(&files_to_sort);
+}
 
-  if (new_upload_failure) {
+/* The index keeps running totals of the bytes waiting in the upload
+ * directories, so crossing a quota costs nothing to detect. */
+static void check_quota() {
+  /* Until the startup scan is done, the oldest files may not be indexed
+   * yet. */
+  if (next_deferred_scan < num_deferred_scans) {
+    return;
+  }
+  if (enforce_quota()) {
     (void)write_upload_failures_log();
   }
 }
 
-static int initialize_curl() {
-  if (curl_global_init(CURL_GLOBAL_ALL)) {
-    syslog(LOG_ERR, "initialize_curl:curl_global_init");
+/* Start uploading the closed files whose debounce has ended. A file closed
+ * again in the meantime has a later debounce deadline than the item being
+ * popped, and waits for its own item. */
+static void upload_closed_files(int64_t current_time) {
+  debounce_item_t* item;
+  while ((item = debounce_queue_pop(&closed_uploads, current_time))) {
+    upload_entry_t* entry = upload_list_find(&pending_uploads, item->filename);
+    if (entry != NULL
+        && entry->debounce_deadline == item->deadline
+        && !entry->pending) {
+      entry->debounce_deadline = -1;
+      syslog(LOG_INFO, "File close detected: %s", item->filename);
+      enqueue_upload(entry, current_time / 1000);
+    }
+    debounce_item_free(item);
+  }
+}
+
+/* Return the earlier of two deadlines, where -1 means no deadline. */
+static int64_t earlier_deadline(int64_t first, int64_t second) {
+  if (first < 0) {
+    return second;
+  } else if (second < 0 || first < second) {
+    return first;
+  } else {
+    return second;
+  }
+}
+
+/* When the main loop must next wake up without a file or socket event, in
+ * milliseconds on the monotonic clock: the next scheduled retry, debounce,
+ * batch deadline, journal flush, metrics update or cURL deadline. -1 if
+ * there is none. */
+static int64_t next_deadline() {
+  int64_t deadline = -1;
+  const upload_entry_t* next_retry
+      = upload_list_next_scheduled(&pending_uploads);
+  time_t ready_time = circuit_breaker_ready_time(&circuit_breaker);
+  if (next_retry != NULL && ready_time >= 0) {
+    time_t retry_time = next_retry->next_attempt > ready_time
+        ? next_retry->next_attempt : ready_time;
+    deadline = (int64_t)retry_time * 1000;
+  }
+  int idx;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    time_t batch_deadline = upload_batch_deadline(&batches[idx]);
+    if (batch_deadline >= 0) {
+      deadline = earlier_deadline(deadline, (int64_t)batch_deadline * 1000);
+    }
+  }
+  deadline = earlier_deadline(deadline,
+                              debounce_queue_deadline(&closed_uploads));
+  if (journal.flush_deadline >= 0) {
+    deadline = earlier_deadline(deadline,
+                                (int64_t)journal.flush_deadline * 1000);
+  }
+  deadline = earlier_deadline(deadline, (int64_t)metrics_deadline * 1000);
+  return earlier_deadline(deadline, upload_engine_deadline(&upload_engine));
+}
+
+/* Arm the timerfd for an absolute deadline on the monotonic clock, or disarm
+ * it for -1. */
+static int set_timer(int timer_handle, int64_t deadline) {
+  struct itimerspec timer;
+  memset(&timer, '\0', sizeof(timer));
+  if (deadline >= 0) {
+    timer.it_value.tv_sec = deadline / 1000;
+    timer.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0) {
+      /* All zeroes would disarm the timer. */
+      timer.it_value.tv_nsec = 1;
+    }
+  }
+  if (timerfd_settime(timer_handle, TFD_TIMER_ABSTIME, &timer, NULL)) {
+    syslog(LOG_ERR, "set_timer:timerfd_settime: %s", strerror(errno));
     return -1;
   }
-  curl_handle = curl_easy_init();
-  if (!curl_handle) {
-    syslog(LOG_ERR, "initialize_curl:curl_easy_init");
+  return 0;
+}
+
+/* Apply the rate limit shared by all directories from CONFIG_FILENAME. */
+static int read_global_config() {
+  directory_config_t config;
+  if (directory_config_read(CONFIG_FILENAME, DIRECTORY_CONFIG_GLOBAL, &config)) {
     return -1;
   }
-  int rc = curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, curl_error_message);
-  if (rc) {
-    syslog(LOG_ERR,
-           "initialize_curl:curl_easy_setopt(CURLOPT_ERRORBUFFER): %s",
-           curl_easy_strerror(rc));
-    curl_easy_cleanup(curl_handle);
+  return upload_engine_set_rate_limit(
+      &upload_engine, -1, config.rate, config.burst);
+}
+
+/* Re-read CONFIG_FILENAME and apply it to the running daemon. */
+static void reload_directory_configs() {
+  if (read_global_config()) {
+    return;
+  }
+  int idx;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    directory_config_t config;
+    if (directory_config_read(CONFIG_FILENAME,
+                              upload_subdirectories[idx],
+                              &config)) {
+      return;
+    }
+    directory_configs[idx] = config;
+    (void)upload_engine_set_rate_limit(
+        &upload_engine, idx, config.rate, config.burst);
+    if (!config.batch) {
+      flush_batch(idx);
+    }
+  }
+  /* Priorities break ties in the schedule, so reschedule everything in
+   * place to keep the heap in order. */
+  for (idx = 0; idx < pending_uploads.length; ++idx) {
+    upload_entry_t* entry = &pending_uploads.entries[idx];
+    entry->priority = directory_configs[entry->index].priority;
+    if (entry->heap_position >= 0) {
+      upload_list_schedule(&pending_uploads, entry, entry->next_attempt);
+    }
+  }
+  check_quota();
+  syslog(LOG_INFO, "Reloaded %s", CONFIG_FILENAME);
+}
+
+/* Make room for one more upload directory in upload_subdirectories and
+ * every array indexed like it. */
+static int reserve_upload_directory() {
+  if (num_upload_subdirectories < upload_directories_capacity) {
+    return 0;
+  }
+  int capacity = upload_directories_capacity > 0
+      ? 2 * upload_directories_capacity
+      : 8;
+  const char** subdirectories = realloc(
+      upload_subdirectories, capacity * sizeof(subdirectories[0]));
+  if (subdirectories != NULL) {
+    upload_subdirectories = subdirectories;
+  }
+  const char** directories = realloc(
+      upload_directories, capacity * sizeof(directories[0]));
+  if (directories != NULL) {
+    upload_directories = directories;
+  }
+  int* descriptors = realloc(
+      watch_descriptors, capacity * sizeof(descriptors[0]));
+  if (descriptors != NULL) {
+    watch_descriptors = descriptors;
+  }
+  int* counters = realloc(failure_counters, capacity * sizeof(counters[0]));
+  if (counters != NULL) {
+    failure_counters = counters;
+  }
+  directory_config_t* configs = realloc(
+      directory_configs, capacity * sizeof(configs[0]));
+  if (configs != NULL) {
+    directory_configs = configs;
+  }
+  upload_batch_t* new_batches = realloc(
+      batches, capacity * sizeof(new_batches[0]));
+  if (new_batches != NULL) {
+    batches = new_batches;
+  }
+  struct timespec* mtimes = realloc(
+      directory_mtimes, capacity * sizeof(mtimes[0]));
+  if (mtimes != NULL) {
+    directory_mtimes = mtimes;
+  }
+  int* fds = realloc(directory_fds, capacity * sizeof(fds[0]));
+  if (fds != NULL) {
+    directory_fds = fds;
+  }
+  upload_metrics_t* metrics = realloc(
+      directory_metrics, capacity * sizeof(metrics[0]));
+  if (metrics != NULL) {
+    directory_metrics = metrics;
+  }
+  if (subdirectories == NULL
+      || directories == NULL
+      || descriptors == NULL
+      || counters == NULL
+      || configs == NULL
+      || new_batches == NULL
+      || mtimes == NULL
+      || fds == NULL
+      || metrics == NULL) {
+    syslog(LOG_ERR, "reserve_upload_directory:realloc: %s", strerror(errno));
     return -1;
   }
-#ifdef DEBUG_MESSAGES
-  syslog(LOG_INFO, "Enabling curl debug messages");
-  if (curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1)) {
-    syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_VERBOSE): %s",
-           curl_error_message);
+  upload_directories_capacity = capacity;
+  return 0;
+}
+
+/* Return the index of an upload subdirectory, or -1. */
+static int find_upload_subdirectory(const char* name) {
+  int idx;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    if (!strcmp(upload_subdirectories[idx], name)) {
+      return idx;
+    }
+  }
+  return -1;
+}
+
+/* Return the index of an upload subdirectory, giving it one if it has none
+ * yet. The directory isn't watched until add_upload_directory(). Return -1
+ * on error. */
+static int register_upload_directory(const char* name) {
+  int idx = find_upload_subdirectory(name);
+  if (idx >= 0) {
+    return idx;
+  }
+  char absolute_path[PATH_MAX + 1];
+  if (reserve_upload_directory()
+      || join_paths(UPLOADS_ROOT, name, absolute_path)) {
     return -1;
   }
-#endif
-  /* CURLOPT_UPLOAD uses HTTP PUT by default. */
-  if (curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1L)) {
+  char* subdirectory = strdup(name);
+  char* directory = strdup(absolute_path);
+  if (subdirectory == NULL || directory == NULL) {
     syslog(LOG_ERR,
-           "initialize_curl:curl_easy_setopt(CURLOPT_UPLOAD): %s",
-           curl_error_message);
-    curl_easy_cleanup(curl_handle);
+           "register_upload_directory:strdup(\"%s\"): %s",
+           absolute_path,
+           strerror(errno));
+    free(subdirectory);
+    free(directory);
     return -1;
   }
-  /* Make cURL return an error if the Web server returns an HTTP error code. */
-  if (curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1)) {
-    syslog(LOG_ERR,
-           "initialize_curl:curl_easy_setopt(CURLOPT_FAILONERROR): %s",
-           curl_error_message);
-    curl_easy_cleanup(curl_handle);
+  idx = num_upload_subdirectories++;
+  upload_subdirectories[idx] = subdirectory;
+  upload_directories[idx] = directory;
+  watch_descriptors[idx] = -1;
+  directory_fds[idx] = -1;
+  failure_counters[idx] = 0;
+  directory_config_init(&directory_configs[idx]);
+  upload_batch_init(&batches[idx]);
+  directory_mtimes[idx].tv_sec = -1;
+  directory_mtimes[idx].tv_nsec = 0;
+  upload_metrics_init(&directory_metrics[idx]);
+  return idx;
+}
+
+/* Return 1 if a directory's modification time is the one recorded by the
+ * last clean shutdown, and 0 otherwise. */
+static int directory_unchanged(int index) {
+  if (directory_mtimes[index].tv_sec < 0) {
+    return 0;
+  }
+  struct stat dir_info;
+  if (stat(upload_directories[index], &dir_info)) {
+    return 0;
+  }
+  return dir_info.st_mtim.tv_sec == directory_mtimes[index].tv_sec
+      && dir_info.st_mtim.tv_nsec == directory_mtimes[index].tv_nsec;
+}
+
+/* Start watching UPLOADS_ROOT/name and index the files already in it, or
+ * with defer set, queue it for the incremental startup scan. Return the
+ * directory's index, or -1 on error. */
+static int add_upload_directory(const char* name, int defer) {
+  int idx = register_upload_directory(name);
+  if (idx < 0) {
     return -1;
+  } else if (watch_descriptors[idx] >= 0) {
+    return idx;
   }
-  if (curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, TRANSFER_TIMEOUT_SECONDS)) {
+  if (directory_config_read(CONFIG_FILENAME,
+                            upload_subdirectories[idx],
+                            &directory_configs[idx])
+      || upload_engine_set_rate_limit(&upload_engine,
+                                      idx,
+                                      directory_configs[idx].rate,
+                                      directory_configs[idx].burst)) {
+    return -1;
+  }
+  int fd = open(upload_directories[idx], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
     syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_TIMEOUT, %d): %s",
-           TRANSFER_TIMEOUT_SECONDS,
-           curl_error_message);
+           "add_upload_directory:open(\"%s\"): %s",
+           upload_directories[idx],
+           strerror(errno));
     return -1;
   }
-  if (curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT_SECONDS)) {
+  int wd = inotify_add_watch(inotify_handle,
+                             upload_directories[idx],
+                             IN_MOVED_TO | IN_CLOSE_WRITE
+                             | IN_DELETE | IN_MOVED_FROM);
+  if (wd < 0) {
     syslog(LOG_ERR,
-           "curl_send:curl_easy_setopt(CURLOPT_CONNECTTIMEOUT, %d): %s",
-           CONNECT_TIMEOUT_SECONDS,
-           curl_error_message);
+           "add_upload_directory:inotify_add_watch(\"%s\"): %s",
+           upload_directories[idx],
+           strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (watch_table_set(&watch_table, wd, idx)) {
+    (void)inotify_rm_watch(inotify_handle, wd);
+    close(fd);
     return -1;
   }
-#ifdef SKIP_SSL_VERIFICATION
-  if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0)) {
+  watch_descriptors[idx] = wd;
+  directory_fds[idx] = fd;
+  /* Without it, uploads fall back to absolute paths. */
+  (void)upload_engine_set_directory_fd(&upload_engine, idx, fd);
+  syslog(LOG_INFO, "Watching %s", upload_directories[idx]);
+  /* Checking the mtime after the watch is in place means no file can slip
+   * between the two, and likewise for the scan. */
+  if (directory_unchanged(idx)) {
+    syslog(LOG_INFO,
+           "%s is unchanged since shutdown; not scanning",
+           upload_directories[idx]);
+  } else {
+    directory_mtimes[idx].tv_sec = -1;
+    if (!defer || defer_scan(idx)) {
+      (void)scan_upload_directory(idx);
+    }
+  }
+  return idx;
+}
+
+/* Stop watching a directory that left UPLOADS_ROOT and forget its files.
+ * Files already handed to the upload engine are settled when their uploads
+ * finish. */
+static void remove_upload_directory(int index) {
+  if (watch_descriptors[index] < 0) {
+    return;
+  }
+  /* This fails harmlessly if the kernel already dropped the watch because
+   * the directory was deleted. */
+  (void)inotify_rm_watch(inotify_handle, watch_descriptors[index]);
+  watch_table_remove(&watch_table, watch_descriptors[index]);
+  watch_descriptors[index] = -1;
+  (void)upload_engine_set_directory_fd(&upload_engine, index, -1);
+  close(directory_fds[index]);
+  directory_fds[index] = -1;
+  if (next_deferred_scan < num_deferred_scans
+      && deferred_scans[next_deferred_scan] == index) {
+    upload_scan_close(&deferred_scan);
+  }
+  flush_batch(index);
+  int idx;
+  /* Removal moves the last entry into the hole, so walk backwards. */
+  for (idx = pending_uploads.length - 1; idx >= 0; --idx) {
+    upload_entry_t* entry = &pending_uploads.entries[idx];
+    if (entry->index == index && !entry->pending) {
+      remove_upload(entry);
+    }
+  }
+  syslog(LOG_INFO, "Stopped watching %s", upload_directories[index]);
+}
+
+/* Add every subdirectory of UPLOADS_ROOT that isn't watched yet, deferring
+ * their scans if defer is set. */
+static int scan_uploads_root(int defer) {
+  DIR* handle = opendir(UPLOADS_ROOT);
+  if (handle == NULL) {
     syslog(LOG_ERR,
-           "initialize_curl:curl_easy_setopt(CURLOPT_SSL_VERIFYPEER): %s",
-           curl_error_message);
-    curl_easy_cleanup(curl_handle);
+           "scan_uploads_root:opendir(\"%s\"): %s",
+           UPLOADS_ROOT,
+           strerror(errno));
     return -1;
   }
-#endif
+  int status = 0;
+  struct dirent* entry;
+  while ((entry = readdir(handle))) {
+    if (entry->d_name[0] == '.') {  /* Skip hidden, ".", and ".." */
+      continue;
+    }
+    char absolute_filename[PATH_MAX + 1];
+    if (join_paths(UPLOADS_ROOT, entry->d_name, absolute_filename)) {
+      status = -1;
+      continue;
+    }
+    struct stat dir_info;
+    if (stat(absolute_filename, &dir_info)) {
+      syslog(LOG_ERR,
+             "scan_uploads_root:stat(\"%s\"): %s",
+             absolute_filename,
+             strerror(errno));
+      status = -1;
+      continue;
+    }
+    if (S_ISDIR(dir_info.st_mode) && add_upload_directory(entry->d_name, defer) < 0) {
+      status = -1;
+    }
+  }
+  (void)closedir(handle);
+  return status;
+}
+
+/* Schedule the entries appended to pending_uploads since it had old_length
+ * entries for right now. Files that turn up outside of inotify events most
+ * likely arrived by a move, so they shouldn't wait for
+ * RETRY_INTERVAL_SECONDS. Return how many there were. */
+static int schedule_new_uploads(int old_length) {
+  time_t current_time = monotonic_seconds();
+  int idx;
+  for (idx = old_length; idx < pending_uploads.length; ++idx) {
+    upload_list_schedule(
+        &pending_uploads, &pending_uploads.entries[idx], current_time);
+  }
+  return pending_uploads.length - old_length;
+}
+
+/* Pick up directories created in or moved into UPLOADS_ROOT, and drop the
+ * ones deleted or moved away. */
+static void handle_root_event(const struct inotify_event* event,
+                              int* indexed) {
+  if (!event->len || !(event->mask & IN_ISDIR) || event->name[0] == '.') {
+    return;
+  }
+  if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+    /* Scanning only appends, so new entries end up past the old length. */
+    int old_length = pending_uploads.length;
+    if (add_upload_directory(event->name, 0) >= 0) {
+      *indexed |= schedule_new_uploads(old_length) > 0;
+      (void)write_upload_failures_log();
+    }
+  } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    int idx = find_upload_subdirectory(event->name);
+    if (idx >= 0) {
+      remove_upload_directory(idx);
+    }
+  }
+}
+
+/* Fill in the upload subdirectory an absolute filename of the form
+ * UPLOADS_ROOT/<directory>/<file> belongs to. directory must be at least
+ * PATH_MAX + 1 bytes long. */
+static int upload_subdirectory_of(const char* filename, char* directory) {
+  size_t root_length = strlen(UPLOADS_ROOT);
+  if (strncmp(filename, UPLOADS_ROOT "/", root_length + 1)) {
+    return -1;
+  }
+  const char* start = filename + root_length + 1;
+  const char* slash = strchr(start, '/');
+  if (slash == NULL
+      || slash == start
+      || start[0] == '.'
+      || strchr(slash + 1, '/') != NULL
+      || slash - start > PATH_MAX) {
+    return -1;
+  }
+  memcpy(directory, start, slash - start);
+  directory[slash - start] = '\0';
+  return 0;
+}
+
+/* Apply one journal record to pending_uploads and the failure counters.
+ * The directories named are registered but not watched yet. userdata
+ * points at a flag that is set while the records seen last are the mtimes
+ * of a clean shutdown. */
+static void replay_journal_record(const upload_journal_record_t* record,
+                                  void* userdata) {
+  int* after_shutdown = userdata;
+  int idx;
+  if (record->type == UPLOAD_JOURNAL_MTIME) {
+    idx = register_upload_directory(record->name);
+    if (idx >= 0) {
+      directory_mtimes[idx].tv_sec = record->time;
+      directory_mtimes[idx].tv_nsec = record->value;
+      *after_shutdown = 1;
+    }
+    return;
+  }
+  if (*after_shutdown) {
+    /* The daemon ran again since that shutdown, so the mtimes are stale. */
+    for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+      directory_mtimes[idx].tv_sec = -1;
+    }
+    *after_shutdown = 0;
+  }
+  if (record->type == UPLOAD_JOURNAL_COUNT) {
+    idx = register_upload_directory(record->name);
+    if (idx >= 0) {
+      failure_counters[idx] = record->value;
+    }
+    return;
+  } else if (record->type == UPLOAD_JOURNAL_ADD) {
+    char directory[PATH_MAX + 1];
+    if (upload_subdirectory_of(record->name, directory) == 0
+        && (idx = register_upload_directory(directory)) >= 0) {
+      (void)upload_list_update(
+          &pending_uploads, record->name, record->time, record->value, idx);
+    }
+    return;
+  }
+  upload_entry_t* entry = upload_list_find(&pending_uploads, record->name);
+  if (entry == NULL) {
+    return;
+  }
+  if (record->type == UPLOAD_JOURNAL_FAIL) {
+    entry->attempts = record->value;
+    time_t delay = record->time - time(NULL);
+    upload_list_schedule(&pending_uploads,
+                         entry,
+                         monotonic_seconds() + (delay > 0 ? delay : 0));
+  } else {
+    if (record->type == UPLOAD_JOURNAL_EVICT) {
+      ++failure_counters[entry->index];
+    }
+    upload_list_remove(&pending_uploads, entry);
+  }
+}
+
+/* Once every upload directory is watched, reconcile the entries restored
+ * from the journal with the files actually there: drop entries whose
+ * directory is gone or, in directories that changed since the last clean
+ * shutdown, whose file is gone. Then give every entry its directory's
+ * priority and schedule the ones without a failed attempt. */
+static void restore_uploads() {
+  int idx;
+  /* Removal moves the last entry into the hole, so walk backwards. */
+  for (idx = pending_uploads.length - 1; idx >= 0; --idx) {
+    upload_entry_t* entry = &pending_uploads.entries[idx];
+    if (watch_descriptors[entry->index] < 0
+        || (directory_mtimes[entry->index].tv_sec < 0
+            && access(upload_list_filename(&pending_uploads, entry), F_OK)
+            && errno == ENOENT)) {
+      upload_list_remove(&pending_uploads, entry);
+    }
+  }
+  for (idx = 0; idx < pending_uploads.length; ++idx) {
+    upload_entry_t* entry = &pending_uploads.entries[idx];
+    entry->priority = directory_configs[entry->index].priority;
+    if (entry->heap_position < 0) {
+      schedule_first_attempt(entry);
+    } else {
+      upload_list_schedule(&pending_uploads, entry, entry->next_attempt);
+    }
+  }
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    directory_mtimes[idx].tv_sec = -1;
+  }
+}
+
+/* Rewrite the journal as a snapshot of pending_uploads and the failure
+ * counters. */
+static int snapshot_journal() {
+  if (upload_journal_begin(&journal)) {
+    return -1;
+  }
+  time_t current_time = monotonic_seconds();
+  int idx;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    if (failure_counters[idx] > 0) {
+      upload_journal_record_t record;
+      record.type = UPLOAD_JOURNAL_COUNT;
+      record.time = 0;
+      record.value = failure_counters[idx];
+      record.name = upload_subdirectories[idx];
+      (void)upload_journal_append(&journal, &record, current_time);
+    }
+  }
+  for (idx = 0; idx < pending_uploads.length; ++idx) {
+    const upload_entry_t* entry = &pending_uploads.entries[idx];
+    journal_entry(UPLOAD_JOURNAL_ADD, entry);
+    if (entry->attempts > 0) {
+      journal_entry(UPLOAD_JOURNAL_FAIL, entry);
+    }
+  }
+  return upload_journal_commit(&journal);
+}
+
+/* Act on one inotify event. Set *indexed if a file was added to the index. */
+static void handle_inotify_event(const struct inotify_event* event,
+                                 int* indexed) {
+  if (event->wd == root_watch_descriptor) {
+    handle_root_event(event, indexed);
+    return;
+  }
+  int idx = watch_table_lookup(&watch_table, event->wd);
+  if (idx < 0) {
+    return;
+  }
+  if (event->mask & IN_IGNORED) {
+    /* The kernel dropped the watch, e.g. because the directory was
+     * deleted. */
+    remove_upload_directory(idx);
+    return;
+  }
+  if (!event->len) {
+    return;
+  }
+  char absolute_path[PATH_MAX + 1];
+  if (join_paths(upload_directories[idx], event->name, absolute_path)) {
+    return;
+  }
+  if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    forget_upload(absolute_path);
+  } else if (event->mask & (IN_MOVED_TO | IN_CLOSE_WRITE)) {
+    /* Files written in place are only indexed unless their directory asks
+     * for them to go out once closed; otherwise they go out once their first
+     * retry comes due. */
+    upload_entry_t* entry = index_upload(idx, event->name, absolute_path);
+    *indexed |= entry != NULL;
+    if (entry == NULL || entry->pending) {
+      return;
+    }
+    if (event->mask & IN_MOVED_TO) {
+      syslog(LOG_INFO, "File move detected: %s", absolute_path);
+      enqueue_upload(entry, monotonic_seconds());
+    } else if (directory_configs[idx].upload_on_close) {
+      entry->debounce_deadline
+          = monotonic_milliseconds() + CLOSE_WRITE_DEBOUNCE_MILLISECONDS;
+      (void)debounce_queue_push(
+          &closed_uploads, absolute_path, entry->debounce_deadline);
+    }
+  }
+}
+
+/* Bring the index back in line with the upload directories after inotify
+ * lost events: forget files that are gone and pick up files that arrived.
+ * New files most likely arrived by a lost move, so they are retried right
+ * away rather than after RETRY_INTERVAL_SECONDS. */
+static void rescan_upload_directories() {
+  int idx;
+  /* Removal moves the last entry into the hole, so walk backwards. */
+  for (idx = pending_uploads.length - 1; idx >= 0; --idx) {
+    upload_entry_t* entry = &pending_uploads.entries[idx];
+    if (!entry->pending
+        && access(upload_list_filename(&pending_uploads, entry), F_OK)
+        && errno == ENOENT) {
+      remove_upload(entry);
+    }
+  }
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    if (watch_descriptors[idx] >= 0
+        && access(upload_directories[idx], F_OK)
+        && errno == ENOENT) {
+      remove_upload_directory(idx);
+    }
+  }
+  /* Scanning only appends, so new entries end up past the old length.
+   * Directories that appeared are scanned as they are added. */
+  int old_length = pending_uploads.length;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    if (watch_descriptors[idx] >= 0) {
+      (void)scan_upload_directory(idx);
+    }
+  }
+  (void)scan_uploads_root(0);
+  int recovered = schedule_new_uploads(old_length);
+  overflow_files_recovered += recovered;
+  syslog(LOG_WARNING,
+         "inotify queue overflowed (%lu times so far); rescan found %d new "
+         "files (%lu so far)",
+         inotify_overflows,
+         recovered,
+         overflow_files_recovered);
+}
+
+/* Drain every event waiting on the non-blocking inotify handle. */
+static int handle_inotify_events() {
+  static char events_buffer[INOTIFY_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  int indexed = 0;
+  int overflowed = 0;
+  while (1) {
+    ssize_t length = read(inotify_handle, events_buffer, sizeof(events_buffer));
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        break;
+      }
+      syslog(LOG_ERR, "handle_inotify_events:read: %s", strerror(errno));
+      return -1;
+    }
+    ssize_t offset = 0;
+    while (offset < length) {
+      const struct inotify_event* event
+          = (const struct inotify_event*)(events_buffer + offset);
+      if (event->mask & IN_Q_OVERFLOW) {
+        overflowed = 1;
+      } else {
+        handle_inotify_event(event, &indexed);
+      }
+      offset += sizeof(*event) + event->len;
+    }
+  }
+  if (overflowed) {
+    ++inotify_overflows;
+    rescan_upload_directories();
+    indexed = 1;
+  }
+  if (indexed) {
+    check_quota();
+  }
   return 0;
 }
 
+/* Append the upload directories' modification times to the journal once
+ * every event that came before them has been handled, so the next startup
+ * can skip scanning directories that stay untouched meanwhile. */
+static void record_clean_shutdown() {
+  int idx;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    struct stat dir_info;
+    directory_mtimes[idx].tv_sec = -1;
+    if (watch_descriptors[idx] >= 0
+        && !stat(upload_directories[idx], &dir_info)) {
+      directory_mtimes[idx] = dir_info.st_mtim;
+    }
+  }
+  /* The journal doesn't know all the files in directories whose scan never
+   * finished. */
+  for (idx = next_deferred_scan; idx < num_deferred_scans; ++idx) {
+    directory_mtimes[deferred_scans[idx]].tv_sec = -1;
+  }
+  /* Events for changes made before the stat()s may still be queued.
+   * Directories that change meanwhile will be scanned after all. */
+  (void)handle_inotify_events();
+  if (journal.lost_records) {
+    return;
+  }
+  /* mtimes only tick as often as the kernel's coarse clock, so a change
+   * right after the stat() could leave a fresh mtime as it was. */
+  time_t settled_time = time(NULL) - 1;
+  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
+    if (directory_unchanged(idx)
+        && directory_mtimes[idx].tv_sec < settled_time) {
+      upload_journal_record_t record;
+      record.type = UPLOAD_JOURNAL_MTIME;
+      record.time = directory_mtimes[idx].tv_sec;
+      record.value = directory_mtimes[idx].tv_nsec;
+      record.name = upload_subdirectories[idx];
+      (void)upload_journal_append(&journal, &record, monotonic_seconds());
+    }
+  }
+}
+
+/* Read the signals waiting on the signalfd. Return 1 if the daemon should
+ * shut down. */
+static int handle_signals(int signal_handle) {
+  struct signalfd_siginfo info;
+  while (read(signal_handle, &info, sizeof(info)) == sizeof(info)) {
+    if (info.ssi_signo == SIGHUP) {
+      reload_directory_configs();
+    } else {
+      syslog(LOG_INFO, "Caught signal %u; shutting down", info.ssi_signo);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int watch_handle(int epoll_handle, int handle) {
+  struct epoll_event event;
+  memset(&event, '\0', sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = handle;
+  if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, handle, &event)) {
+    syslog(LOG_ERR, "watch_handle:epoll_ctl(%d): %s", handle, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int initialize_curl(int epoll_handle) {
+  if (curl_global_init(CURL_GLOBAL_ALL)) {
+    syslog(LOG_ERR, "initialize_curl:curl_global_init");
+    return -1;
+  }
+#ifdef DEBUG_MESSAGES
+  syslog(LOG_INFO, "Enabling curl debug messages");
+#endif
+  return upload_engine_init(&upload_engine,
+                            uploads_url,
+                            bismark_id,
+                            MAX_CONCURRENT_UPLOADS,
+                            handle_upload_done,
+                            epoll_handle);
+}
+
 int read_bismark_id() {
   FILE* handle = fopen(BISMARK_ID_FILENAME, "r");
   if (handle == NULL) {
@@ -493,133 +1553,183 @@ int main(int argc, char** argv) {
   if (read_bismark_id()) {
     return 1;
   }
+  backoff_seed(bismark_id);
+  circuit_breaker_init(&circuit_breaker,
+                       CIRCUIT_BREAKER_THRESHOLD,
+                       RETRY_INTERVAL_SECONDS,
+                       MAX_RETRY_INTERVAL_SECONDS);
 
-  if (initialize_upload_subdirectories() || initialize_upload_directories()) {
+  if (upload_list_init(&pending_uploads)) {
     return 1;
   }
 
-  failure_counters = calloc(num_upload_subdirectories,
-                            sizeof(failure_counters[0]));
-  if (failure_counters == NULL) {
-    syslog(LOG_ERR, "main:calloc: %s", strerror(errno));
+  /* Shutdown and reload requests arrive through a signalfd, so the signals
+   * must be blocked before any other thread (e.g. cURL's resolver) exists. */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &signals, NULL)) {
+    syslog(LOG_ERR, "main:sigprocmask: %s", strerror(errno));
     return 1;
   }
-  if (write_upload_failures_log()) {
+  int signal_handle = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_handle < 0) {
+    syslog(LOG_ERR, "main:signalfd: %s", strerror(errno));
+    return 1;
+  }
+  int timer_handle = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_handle < 0) {
+    syslog(LOG_ERR, "main:timerfd_create: %s", strerror(errno));
+    return 1;
+  }
+  int epoll_handle = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_handle < 0) {
+    syslog(LOG_ERR, "main:epoll_create1: %s", strerror(errno));
     return 1;
   }
 
-  if (initialize_curl()) {
+  if (initialize_curl(epoll_handle) || read_global_config()) {
     return 1;
   }
 
   /* Initialize inotify */
-  int inotify_handle = inotify_init();
+  inotify_handle = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
   if (inotify_handle < 0) {
-    syslog(LOG_ERR, "main:inotify_init: %s", strerror(errno));
+    syslog(LOG_ERR, "main:inotify_init1: %s", strerror(errno));
     return 1;
   }
-  int idx;
-  watch_descriptors = calloc(num_upload_subdirectories,
-                             sizeof(watch_descriptors[0]));
-  if (watch_descriptors == NULL) {
-    syslog(LOG_ERR, "main:calloc: %s", strerror(errno));
+  if (watch_handle(epoll_handle, inotify_handle)
+      || watch_handle(epoll_handle, timer_handle)
+      || watch_handle(epoll_handle, signal_handle)) {
     return 1;
   }
-  for (idx = 0; idx < num_upload_subdirectories; ++idx) {
-    watch_descriptors[idx] = inotify_add_watch(inotify_handle,
-                                               upload_directories[idx],
-                                               IN_MOVED_TO);
-    if (watch_descriptors[idx] < 0) {
-      syslog(LOG_ERR,
-             "main:inotify_add_watch(\"%s\"): %s",
-             upload_directories[idx],
-             strerror(errno));
-      return 1;
-    }
-    syslog(LOG_INFO, "Watching %s", upload_directories[idx]);
+  watch_table_init(&watch_table);
+  debounce_queue_init(&closed_uploads);
+  /* Watch UPLOADS_ROOT before scanning it so no new directory can slip
+   * between the two. */
+  root_watch_descriptor = inotify_add_watch(inotify_handle,
+                                            UPLOADS_ROOT,
+                                            IN_ONLYDIR | IN_CREATE
+                                            | IN_MOVED_TO | IN_DELETE
+                                            | IN_MOVED_FROM);
+  if (root_watch_descriptor < 0) {
+    syslog(LOG_ERR,
+           "main:inotify_add_watch(\"%s\"): %s",
+           UPLOADS_ROOT,
+           strerror(errno));
+    return 1;
   }
-
-  time_t current_time = time(NULL);
-  if (current_time < 0) {
-    syslog(LOG_ERR, "main:time: %s", strerror(errno));
+  /* Entries restored from the journal keep their attempts, and directories
+   * left untouched since a clean shutdown aren't scanned. Records appended
+   * before the journal is rewritten below are lost on purpose; the snapshot
+   * supersedes them. */
+  upload_journal_init(&journal, JOURNAL_FILENAME);
+  int after_shutdown = 0;
+  (void)upload_journal_replay(
+      JOURNAL_FILENAME, replay_journal_record, &after_shutdown);
+  int restored = pending_uploads.length;
+  upload_scan_init(&deferred_scan);
+  if (scan_uploads_root(1)) {
+    return 1;
+  }
+  restore_uploads();
+  syslog(LOG_INFO,
+         "Restored %d pending uploads from %s",
+         restored,
+         JOURNAL_FILENAME);
+  (void)snapshot_journal();
+  if (write_upload_failures_log()) {
     return 1;
   }
-  time_t last_retry_time = current_time - RETRY_INTERVAL_SECONDS;
+  check_quota();
+  (void)write_metrics();
+  metrics_deadline = monotonic_seconds() + METRICS_INTERVAL_SECONDS;
 
-  while (1) {
-    current_time = time(NULL);
-    if (current_time < 0) {
-      syslog(LOG_ERR, "main:time: %s", strerror(errno));
-      return 1;
+  int64_t timer_deadline = -1;
+  int scanning = num_deferred_scans > 0;
+  int running = 1;
+  int status = 1;
+  while (running) {
+    /* Sleep until the next deadline. With none, only a file, socket or
+     * signal event can wake us up. While the startup scan runs, just poll
+     * between batches. */
+    int64_t deadline = next_deadline();
+    if (deadline != timer_deadline) {
+      if (set_timer(timer_handle, deadline)) {
+        break;
+      }
+      timer_deadline = deadline;
     }
-
-    fd_set select_set;
-    FD_ZERO(&select_set);
-    FD_SET(inotify_handle, &select_set);
-    struct timeval select_timeout;
-    select_timeout.tv_sec =
-        RETRY_INTERVAL_SECONDS - (current_time - last_retry_time);
-    if (select_timeout.tv_sec < 0) {
-      select_timeout.tv_sec = 0;
-    }
-    select_timeout.tv_usec = 0;
-    int select_result = select(
-        inotify_handle + 1, &select_set, NULL, NULL, &select_timeout);
-    if (select_result < 0) {
-      syslog(LOG_ERR, "main:select: %s", strerror(errno));
-      curl_easy_cleanup(curl_handle);
-      return 1;
-    } else if (select_result > 0) {
-      if (FD_ISSET(inotify_handle, &select_set)) {
-        char events_buffer[BUF_LEN];
-        int length = read(inotify_handle, events_buffer, BUF_LEN);
-        if (length < 0) {
-          syslog(LOG_ERR, "main:read: %s", strerror(errno));
-          curl_easy_cleanup(curl_handle);
-          return 1;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int num_events = epoll_wait(
+        epoll_handle, events, MAX_EPOLL_EVENTS, scanning ? 0 : -1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "main:epoll_wait: %s", strerror(errno));
+      break;
+    }
+    int idx;
+    for (idx = 0; idx < num_events; ++idx) {
+      int handle = events[idx].data.fd;
+      if (handle == inotify_handle) {
+        if (handle_inotify_events()) {
+          running = 0;
         }
-        int offset = 0;
-        while (offset < length) {
-          struct inotify_event* event \
-            = (struct inotify_event*)(events_buffer + offset);
-          if (event->len && (event->mask & IN_MOVED_TO)) {
-            int idx;
-            for (idx = 0; idx < num_upload_subdirectories; ++idx) {
-              if (event->wd == watch_descriptors[idx]) {
-                char absolute_path[PATH_MAX + 1];
-                if (join_paths(
-                      upload_directories[idx], event->name, absolute_path)) {
-                  break;
-                }
-                syslog(LOG_INFO, "File move detected: %s", absolute_path);
-                if (!curl_send(absolute_path, upload_subdirectories[idx])) {
-                  if (unlink(absolute_path)) {
-                    syslog(LOG_ERR,
-                           "main:unlink(\"%s\"): %s",
-                           absolute_path,
-                           strerror(errno));
-                  }
-                }
-                break;
-              }
-            }
-          }
-          offset += sizeof(*event) + event->len;
+      } else if (handle == timer_handle) {
+        uint64_t expirations;
+        (void)read(timer_handle, &expirations, sizeof(expirations));
+        /* A fired timer stays disarmed until it is set again. */
+        timer_deadline = -1;
+      } else if (handle == signal_handle) {
+        if (handle_signals(signal_handle)) {
+          running = 0;
+          status = 0;
         }
+      } else if (upload_engine_socket_event(
+                   &upload_engine, handle, events[idx].events)) {
+        running = 0;
       }
-    } else if (select_result == 0) {
-      current_time = time(NULL);
-      if (current_time < 0) {
-        syslog(LOG_ERR, "main:time: %s", strerror(errno));
-        return 1;
-      }
-      retry_uploads(current_time);
-      last_retry_time = time(NULL);
-      if (last_retry_time < 0) {
-        syslog(LOG_ERR, "main:time: %s", strerror(errno));
-        return 1;
-      }
+    }
+    if (!running) {
+      break;
+    }
+
+    if (scanning && !(scanning = continue_deferred_scans())) {
+      check_quota();
+    }
+    upload_closed_files(monotonic_milliseconds());
+    flush_batches(monotonic_seconds(), 0);
+    if (upload_engine_perform(&upload_engine)) {
+      break;
+    }
+    retry_uploads(monotonic_seconds());
+
+    if (journal.num_records > JOURNAL_COMPACT_RECORDS
+        && journal.num_records > 4 * pending_uploads.length) {
+      (void)snapshot_journal();
+    }
+    (void)upload_journal_flush(&journal, monotonic_seconds(), 0);
+    if (metrics_deadline <= monotonic_seconds()) {
+      (void)write_metrics();
+      metrics_deadline = monotonic_seconds() + METRICS_INTERVAL_SECONDS;
     }
   }
-  return 0;
+
+  shutting_down = 1;
+  if (status == 0) {
+    record_clean_shutdown();
+  }
+  upload_journal_close(&journal);
+  upload_scan_close(&deferred_scan);
+  upload_engine_destroy(&upload_engine);
+  watch_table_destroy(&watch_table);
+  debounce_queue_destroy(&closed_uploads);
+  curl_global_cleanup();
+  (void)write_upload_failures_log();
+  (void)write_metrics();
+  return status;
 }
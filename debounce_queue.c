@@ -0,0 +1,70 @@
+#include "debounce_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+void debounce_queue_init(debounce_queue_t* queue) {
+  queue->head = NULL;
+  queue->tail = NULL;
+}
+
+void debounce_queue_destroy(debounce_queue_t* queue) {
+  while (queue->head != NULL) {
+    debounce_item_t* item = queue->head;
+    queue->head = item->next;
+    debounce_item_free(item);
+  }
+  debounce_queue_init(queue);
+}
+
+int debounce_queue_push(debounce_queue_t* queue,
+                        const char* filename,
+                        int64_t deadline) {
+  debounce_item_t* item = malloc(sizeof(*item));
+  if (item == NULL) {
+    syslog(LOG_ERR, "debounce_queue_push:malloc: %s", strerror(errno));
+    return -1;
+  }
+  item->filename = strdup(filename);
+  if (item->filename == NULL) {
+    syslog(LOG_ERR,
+           "debounce_queue_push:strdup(\"%s\"): %s",
+           filename,
+           strerror(errno));
+    free(item);
+    return -1;
+  }
+  item->deadline = deadline;
+  item->next = NULL;
+  if (queue->tail == NULL) {
+    queue->head = item;
+  } else {
+    queue->tail->next = item;
+  }
+  queue->tail = item;
+  return 0;
+}
+
+int64_t debounce_queue_deadline(const debounce_queue_t* queue) {
+  return queue->head == NULL ? -1 : queue->head->deadline;
+}
+
+debounce_item_t* debounce_queue_pop(debounce_queue_t* queue,
+                                    int64_t current_time) {
+  debounce_item_t* item = queue->head;
+  if (item == NULL || item->deadline > current_time) {
+    return NULL;
+  }
+  queue->head = item->next;
+  if (queue->head == NULL) {
+    queue->tail = NULL;
+  }
+  return item;
+}
+
+void debounce_item_free(debounce_item_t* item) {
+  free(item->filename);
+  free(item);
+}
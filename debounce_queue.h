@@ -0,0 +1,38 @@
+#ifndef _BISMARK_DATA_TRANSMIT_DEBOUNCE_QUEUE_H_
+#define _BISMARK_DATA_TRANSMIT_DEBOUNCE_QUEUE_H_
+
+#include <stdint.h>
+
+typedef struct debounce_item {
+  char* filename;
+  int64_t deadline;
+  struct debounce_item* next;
+} debounce_item_t;
+
+/* Files waiting for a quiet period to end before they are uploaded, in
+ * deadline order. Every file gets the same quiet period, so pushing onto the
+ * tail keeps the queue sorted. A file pushed again before its deadline
+ * appears twice; the caller tells stale items apart by their deadline. */
+typedef struct {
+  debounce_item_t* head;
+  debounce_item_t* tail;
+} debounce_queue_t;
+
+void debounce_queue_init(debounce_queue_t* queue);
+void debounce_queue_destroy(debounce_queue_t* queue);
+
+/* Add a file whose quiet period ends at deadline. */
+int debounce_queue_push(debounce_queue_t* queue,
+                        const char* filename,
+                        int64_t deadline);
+
+/* The earliest deadline in the queue, or -1 if it's empty. */
+int64_t debounce_queue_deadline(const debounce_queue_t* queue);
+
+/* Remove the first item if its deadline is no later than current_time and
+ * return it, or return NULL. Free it with debounce_item_free(). */
+debounce_item_t* debounce_queue_pop(debounce_queue_t* queue,
+                                    int64_t current_time);
+void debounce_item_free(debounce_item_t* item);
+
+#endif
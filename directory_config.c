@@ -0,0 +1,139 @@
+#include "directory_config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define MAX_LINE_LENGTH  1024
+#define WHITESPACE  " \t\r\n"
+
+void directory_config_init(directory_config_t* config) {
+  config->batch = 0;
+  config->encoding = UPLOAD_ENCODING_IDENTITY;
+  config->quota = 0;
+  config->priority = 0;
+  config->upload_on_close = 0;
+  config->rate = 0;
+  config->burst = 0;
+}
+
+static int parse_boolean(const char* value, int* result) {
+  if (!strcmp(value, "1") || !strcmp(value, "yes")
+      || !strcmp(value, "true") || !strcmp(value, "on")) {
+    *result = 1;
+  } else if (!strcmp(value, "0") || !strcmp(value, "no")
+      || !strcmp(value, "false") || !strcmp(value, "off")) {
+    *result = 0;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_integer(const char* value, int* result) {
+  char* end;
+  errno = 0;
+  long parsed = strtol(value, &end, 10);
+  if (errno || end == value || *end != '\0'
+      || parsed < INT_MIN || parsed > INT_MAX) {
+    return -1;
+  }
+  *result = parsed;
+  return 0;
+}
+
+static int parse_size(const char* value, size_t* result) {
+  char* end;
+  errno = 0;
+  unsigned long long parsed = strtoull(value, &end, 10);
+  if (errno || end == value || *value == '-') {
+    return -1;
+  }
+  unsigned long long multiplier = 1;
+  if (!strcmp(end, "k") || !strcmp(end, "K")) {
+    multiplier = 1024;
+  } else if (!strcmp(end, "m") || !strcmp(end, "M")) {
+    multiplier = 1024 * 1024;
+  } else if (*end != '\0') {
+    return -1;
+  }
+  if (parsed > (size_t)-1 / multiplier) {
+    return -1;
+  }
+  *result = parsed * multiplier;
+  return 0;
+}
+
+static int parse_option(directory_config_t* config,
+                        const char* key,
+                        const char* value) {
+  if (!strcmp(key, "batch")) {
+    return parse_boolean(value, &config->batch);
+  } else if (!strcmp(key, "compress")) {
+    return upload_encoding_parse(value, &config->encoding);
+  } else if (!strcmp(key, "quota")) {
+    return parse_size(value, &config->quota);
+  } else if (!strcmp(key, "priority")) {
+    return parse_integer(value, &config->priority);
+  } else if (!strcmp(key, "on_close")) {
+    return parse_boolean(value, &config->upload_on_close);
+  } else if (!strcmp(key, "rate")) {
+    return parse_size(value, &config->rate);
+  } else if (!strcmp(key, "burst")) {
+    return parse_size(value, &config->burst);
+  }
+  return -1;
+}
+
+int directory_config_read(const char* filename,
+                          const char* directory,
+                          directory_config_t* config) {
+  directory_config_init(config);
+  FILE* handle = fopen(filename, "r");
+  if (handle == NULL) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    syslog(LOG_ERR,
+           "directory_config_read:fopen(\"%s\"): %s",
+           filename,
+           strerror(errno));
+    return -1;
+  }
+  char line[MAX_LINE_LENGTH];
+  while (fgets(line, sizeof(line), handle)) {
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char* saveptr;
+    char* name = strtok_r(line, WHITESPACE, &saveptr);
+    if (name == NULL || strcmp(name, directory)) {
+      continue;
+    }
+    char* option;
+    while ((option = strtok_r(NULL, WHITESPACE, &saveptr))) {
+      char* value = strchr(option, '=');
+      if (value == NULL) {
+        syslog(LOG_WARNING,
+               "directory_config_read:%s: option \"%s\" has no value",
+               directory,
+               option);
+        continue;
+      }
+      *value++ = '\0';
+      if (parse_option(config, option, value)) {
+        syslog(LOG_WARNING,
+               "directory_config_read:%s: ignoring %s=%s",
+               directory,
+               option,
+               value);
+      }
+    }
+  }
+  fclose(handle);
+  return 0;
+}
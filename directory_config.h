@@ -0,0 +1,55 @@
+#ifndef _BISMARK_DATA_TRANSMIT_DIRECTORY_CONFIG_H_
+#define _BISMARK_DATA_TRANSMIT_DIRECTORY_CONFIG_H_
+
+#include <stddef.h>
+
+#include "upload_body.h"
+
+/* The name under which the configuration file holds the shared settings. It
+ * can't be mistaken for a subdirectory. */
+#define DIRECTORY_CONFIG_GLOBAL  "/"
+
+/* Per-directory upload settings.
+ *
+ * The configuration file lists one upload subdirectory per line, optionally
+ * followed by whitespace separated key=value options:
+ *
+ *   passive
+ *   passive-frequent batch=1 compress=gzip
+ *   measurements quota=1M priority=10
+ *   latency on_close=1
+ *   bulk rate=16k burst=256k
+ *   / rate=64k
+ *
+ * Blank lines and text after '#' are ignored. Directories that don't appear
+ * in the file use the defaults. The line for "/" sets the rate limit shared
+ * by all directories; its other options are ignored. */
+typedef struct {
+  /* Coalesce small files into archive uploads. */
+  int batch;
+  /* Content-Encoding used to compress uploads on the fly. */
+  upload_encoding_t encoding;
+  /* Bytes this directory may hold before its oldest files are deleted, or 0
+   * for no limit beyond the global quota. Sizes take a k or M suffix. */
+  size_t quota;
+  /* Higher priority files are uploaded first and deleted last. */
+  int priority;
+  /* Upload files written in place once they have been closed and left
+   * alone for a moment, instead of waiting for their first retry. */
+  int upload_on_close;
+  /* Cap on the upload rate in bytes per second, or 0 for none, and how many
+   * bytes may go out at once after a quiet spell (0 for one second's
+   * worth). Both take a k or M suffix. */
+  size_t rate;
+  size_t burst;
+} directory_config_t;
+
+void directory_config_init(directory_config_t* config);
+
+/* Fill config with the options for directory from the configuration file.
+ * A missing file is not an error. */
+int directory_config_read(const char* filename,
+                          const char* directory,
+                          directory_config_t* config);
+
+#endif
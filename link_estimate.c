@@ -0,0 +1,155 @@
+#include "link_estimate.h"
+
+/* Timeouts used until the link has been measured. The connect timeout also
+ * caps the measured one. */
+#ifndef TRANSFER_TIMEOUT_SECONDS
+#define TRANSFER_TIMEOUT_SECONDS 300
+#endif
+#ifndef CONNECT_TIMEOUT_SECONDS
+#define CONNECT_TIMEOUT_SECONDS 300
+#endif
+#define MIN_CONNECT_TIMEOUT_SECONDS  10
+/* A connection, with its TLS handshake, gets this many round trips. */
+#define CONNECT_TIMEOUT_ROUND_TRIPS  20
+#define MIN_TRANSFER_TIMEOUT_SECONDS  30
+#define MAX_TRANSFER_TIMEOUT_SECONDS  86400
+/* A transfer gets this many times as long as it should take. */
+#define TRANSFER_TIMEOUT_MARGIN  4
+/* Round trips a transfer spends on handshakes and waiting for the response,
+ * on top of sending the body. */
+#define TRANSFER_ROUND_TRIPS  4
+/* Smaller uploads are over too quickly to tell the link's speed. */
+#define MIN_SPEED_SAMPLE_BYTES  16384
+/* Weight of a new sample in the moving averages. */
+#define SAMPLE_WEIGHT  0.25
+/* Don't split the link so many ways that an upload gets less than this
+ * many bytes per second. */
+#ifndef MIN_UPLOAD_RATE
+#define MIN_UPLOAD_RATE  2048
+#endif
+/* A transfer is stalled when it sends less than this fraction of its share
+ * of the link for MIN_LOW_SPEED_SECONDS, or for LOW_SPEED_ROUND_TRIPS round
+ * trips if that is longer. */
+#define LOW_SPEED_FRACTION  10
+#define MIN_LOW_SPEED_SECONDS  60
+#define LOW_SPEED_ROUND_TRIPS  20
+
+void link_estimate_init(link_estimate_t* estimate, int max_concurrency) {
+  estimate->throughput = 0;
+  estimate->round_trip_time = 0;
+  estimate->max_concurrency = max_concurrency > 0 ? max_concurrency : 1;
+  estimate->window = estimate->max_concurrency;
+}
+
+static void update_average(double* average, double sample) {
+  if (*average <= 0) {
+    *average = sample;
+  } else {
+    *average += SAMPLE_WEIGHT * (sample - *average);
+  }
+}
+
+void link_estimate_success(link_estimate_t* estimate,
+                           off_t bytes_sent,
+                           double speed,
+                           int concurrent,
+                           double round_trip_time) {
+  if (bytes_sent >= MIN_SPEED_SAMPLE_BYTES && speed > 0) {
+    /* Concurrent transfers share the link, so it carries about this much in
+     * all. */
+    update_average(&estimate->throughput,
+                   speed * (concurrent > 0 ? concurrent : 1));
+  }
+  if (round_trip_time > 0) {
+    update_average(&estimate->round_trip_time, round_trip_time);
+  }
+  estimate->window += 1 / estimate->window;
+  if (estimate->window > estimate->max_concurrency) {
+    estimate->window = estimate->max_concurrency;
+  }
+}
+
+void link_estimate_timeout(link_estimate_t* estimate) {
+  /* A long outage shouldn't talk the estimates down (or up) so far that it
+   * takes many uploads to recover after it. */
+  double lowest = estimate->throughput < MIN_UPLOAD_RATE
+      ? estimate->throughput : MIN_UPLOAD_RATE;
+  estimate->throughput /= 2;
+  if (estimate->throughput < lowest) {
+    estimate->throughput = lowest;
+  }
+  estimate->round_trip_time *= 2;
+  if (estimate->round_trip_time
+      > (double)CONNECT_TIMEOUT_SECONDS / CONNECT_TIMEOUT_ROUND_TRIPS) {
+    estimate->round_trip_time
+        = (double)CONNECT_TIMEOUT_SECONDS / CONNECT_TIMEOUT_ROUND_TRIPS;
+  }
+  estimate->window /= 2;
+  if (estimate->window < 1) {
+    estimate->window = 1;
+  }
+}
+
+int link_estimate_concurrency(const link_estimate_t* estimate) {
+  int concurrency = (int)estimate->window;
+  if (estimate->throughput > 0
+      && concurrency > estimate->throughput / MIN_UPLOAD_RATE) {
+    concurrency = (int)(estimate->throughput / MIN_UPLOAD_RATE);
+  }
+  return concurrency > 0 ? concurrency : 1;
+}
+
+long link_estimate_connect_timeout(const link_estimate_t* estimate) {
+  if (estimate->round_trip_time <= 0) {
+    return CONNECT_TIMEOUT_SECONDS;
+  }
+  double timeout = CONNECT_TIMEOUT_ROUND_TRIPS * estimate->round_trip_time;
+  if (timeout < MIN_CONNECT_TIMEOUT_SECONDS) {
+    return MIN_CONNECT_TIMEOUT_SECONDS;
+  } else if (timeout > CONNECT_TIMEOUT_SECONDS) {
+    return CONNECT_TIMEOUT_SECONDS;
+  }
+  return (long)timeout + 1;
+}
+
+/* The bytes per second one of concurrent transfers can expect. */
+static double share(const link_estimate_t* estimate, int concurrent) {
+  return estimate->throughput / (concurrent > 0 ? concurrent : 1);
+}
+
+long link_estimate_transfer_timeout(const link_estimate_t* estimate,
+                                    off_t length,
+                                    int concurrent,
+                                    size_t rate_limit) {
+  if (estimate->throughput <= 0) {
+    return TRANSFER_TIMEOUT_SECONDS
+        + (rate_limit > 0 ? TRANSFER_TIMEOUT_MARGIN * length / rate_limit : 0);
+  }
+  double rate = share(estimate, concurrent);
+  if (rate_limit > 0 && rate_limit < rate) {
+    rate = rate_limit;
+  }
+  double timeout = TRANSFER_TIMEOUT_MARGIN
+      * (length / rate + TRANSFER_ROUND_TRIPS * estimate->round_trip_time);
+  if (timeout < MIN_TRANSFER_TIMEOUT_SECONDS) {
+    return MIN_TRANSFER_TIMEOUT_SECONDS;
+  } else if (timeout > MAX_TRANSFER_TIMEOUT_SECONDS) {
+    return MAX_TRANSFER_TIMEOUT_SECONDS;
+  }
+  return (long)timeout + 1;
+}
+
+long link_estimate_low_speed_limit(const link_estimate_t* estimate,
+                                   int concurrent,
+                                   long* seconds) {
+  if (estimate->throughput <= 0) {
+    *seconds = 0;
+    return 0;
+  }
+  *seconds = LOW_SPEED_ROUND_TRIPS * estimate->round_trip_time;
+  if (*seconds < MIN_LOW_SPEED_SECONDS) {
+    *seconds = MIN_LOW_SPEED_SECONDS;
+  }
+  long limit = share(estimate, concurrent) / LOW_SPEED_FRACTION;
+  return limit > 0 ? limit : 1;
+}
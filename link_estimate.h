@@ -0,0 +1,65 @@
+#ifndef _BISMARK_DATA_TRANSMIT_LINK_ESTIMATE_H_
+#define _BISMARK_DATA_TRANSMIT_LINK_ESTIMATE_H_
+
+#include <sys/types.h>
+
+/* What finished transfers say about the link to the server, and the
+ * transfer settings that follow from it.
+ *
+ * Throughput and round trip time are moving averages of the upload speed of
+ * transfers big enough to measure it and of the TCP connect time of new
+ * connections. Until the first sample of each, the compile-time timeouts
+ * apply unchanged. A timeout makes both estimates more pessimistic, so one
+ * slow spell can't keep every following upload timing out.
+ *
+ * Concurrency grows by one upload per round of successful uploads and halves
+ * on a timeout, and never runs more uploads than the measured capacity can
+ * feed at a useful rate each. */
+typedef struct {
+  /* Bytes per second of the link as a whole, or 0 if unknown. */
+  double throughput;
+  /* Seconds, or 0 if unknown. */
+  double round_trip_time;
+  /* How many uploads may run at once, as a fraction so it can grow
+   * gradually. */
+  double window;
+  int max_concurrency;
+} link_estimate_t;
+
+void link_estimate_init(link_estimate_t* estimate, int max_concurrency);
+
+/* Learn from a successful transfer. speed is its average upload speed in
+ * bytes per second and concurrent the number of transfers that ran
+ * alongside it, including itself. round_trip_time is -1 if the transfer
+ * reused a connection. */
+void link_estimate_success(link_estimate_t* estimate,
+                           off_t bytes_sent,
+                           double speed,
+                           int concurrent,
+                           double round_trip_time);
+
+/* Learn from a transfer that timed out or ran too slowly. */
+void link_estimate_timeout(link_estimate_t* estimate);
+
+/* How many uploads should run at once. */
+int link_estimate_concurrency(const link_estimate_t* estimate);
+
+/* Seconds to allow for connecting, including the TLS handshake. */
+long link_estimate_connect_timeout(const link_estimate_t* estimate);
+
+/* Seconds to allow for a whole transfer of length bytes, each of
+ * concurrent transfers getting an equal share of the link, and none getting
+ * more than rate_limit bytes per second (0 for no limit). */
+long link_estimate_transfer_timeout(const link_estimate_t* estimate,
+                                    off_t length,
+                                    int concurrent,
+                                    size_t rate_limit);
+
+/* The average upload speed in bytes per second below which a transfer that
+ * has lasted *seconds is given up as stalled. 0 if stalls aren't detected,
+ * which is the case until the throughput is known. */
+long link_estimate_low_speed_limit(const link_estimate_t* estimate,
+                                   int concurrent,
+                                   long* seconds);
+
+#endif
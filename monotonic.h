@@ -0,0 +1,13 @@
+#ifndef _BISMARK_DATA_TRANSMIT_MONOTONIC_H_
+#define _BISMARK_DATA_TRANSMIT_MONOTONIC_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* Time on CLOCK_MONOTONIC, which doesn't jump when the wall clock is set
+ * (e.g. by NTP after a router boots). All deadlines are kept on this clock;
+ * wall clock time is only used for file timestamps. */
+int64_t monotonic_milliseconds();
+time_t monotonic_seconds();
+
+#endif
@@ -0,0 +1,62 @@
+#include "token_bucket.h"
+
+void token_bucket_init(token_bucket_t* bucket) {
+  bucket->rate = 0;
+  bucket->burst = 0;
+  bucket->tokens = 0;
+  bucket->updated = 0;
+}
+
+void token_bucket_configure(token_bucket_t* bucket,
+                            size_t rate,
+                            size_t burst,
+                            int64_t current_time) {
+  int was_limited = bucket->rate > 0;
+  if (was_limited) {
+    (void)token_bucket_available(bucket, current_time);
+  }
+  bucket->rate = rate;
+  bucket->burst = burst > 0 ? burst : rate;
+  if (!was_limited || bucket->tokens > bucket->burst) {
+    bucket->tokens = bucket->burst;
+  }
+  bucket->updated = current_time;
+}
+
+size_t token_bucket_available(token_bucket_t* bucket, int64_t current_time) {
+  if (bucket->rate == 0) {
+    return SIZE_MAX;
+  }
+  if (current_time > bucket->updated) {
+    bucket->tokens += (double)bucket->rate
+        * (current_time - bucket->updated) / 1000;
+    if (bucket->tokens > bucket->burst) {
+      bucket->tokens = bucket->burst;
+    }
+    bucket->updated = current_time;
+  }
+  return bucket->tokens > 0 ? (size_t)bucket->tokens : 0;
+}
+
+void token_bucket_take(token_bucket_t* bucket, size_t bytes) {
+  if (bucket->rate > 0) {
+    bucket->tokens -= bytes;
+  }
+}
+
+int64_t token_bucket_ready_time(const token_bucket_t* bucket,
+                                size_t bytes,
+                                int64_t current_time) {
+  if (bucket->rate == 0) {
+    return current_time;
+  }
+  if (bytes > bucket->burst) {
+    bytes = bucket->burst;
+  }
+  double missing = bytes - bucket->tokens;
+  if (missing <= 0) {
+    return current_time;
+  }
+  /* Round up so the tokens are really there when the time comes. */
+  return current_time + (int64_t)(missing * 1000 / bucket->rate) + 1;
+}
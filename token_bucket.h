@@ -0,0 +1,40 @@
+#ifndef _BISMARK_DATA_TRANSMIT_TOKEN_BUCKET_H_
+#define _BISMARK_DATA_TRANSMIT_TOKEN_BUCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Limits a byte rate while allowing bursts. Tokens accrue at rate bytes per
+ * second up to burst bytes, and every byte sent takes one. A rate of 0 means
+ * no limit. Times are monotonic milliseconds. */
+typedef struct {
+  size_t rate;
+  size_t burst;
+  double tokens;
+  int64_t updated;
+} token_bucket_t;
+
+/* Start out unlimited. */
+void token_bucket_init(token_bucket_t* bucket);
+
+/* Change the rate and burst. A burst of 0 allows one second's worth of
+ * bytes. A bucket that wasn't limited before starts out full; otherwise it
+ * keeps the tokens it has, up to the new burst. */
+void token_bucket_configure(token_bucket_t* bucket,
+                            size_t rate,
+                            size_t burst,
+                            int64_t current_time);
+
+/* The number of bytes that may be sent now, or SIZE_MAX if unlimited. */
+size_t token_bucket_available(token_bucket_t* bucket, int64_t current_time);
+
+/* Spend tokens on bytes that were sent. */
+void token_bucket_take(token_bucket_t* bucket, size_t bytes);
+
+/* When the bucket will hold bytes tokens, or burst tokens if that is fewer.
+ * Call token_bucket_available() first to bring it up to date. */
+int64_t token_bucket_ready_time(const token_bucket_t* bucket,
+                                size_t bytes,
+                                int64_t current_time);
+
+#endif
@@ -0,0 +1,104 @@
+#include "upload_batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#ifndef BATCH_WINDOW_SECONDS
+#define BATCH_WINDOW_SECONDS  10
+#endif
+#ifndef BATCH_MAX_BYTES
+#define BATCH_MAX_BYTES  (256 * 1024)
+#endif
+#ifndef BATCH_MAX_FILES
+#define BATCH_MAX_FILES  256
+#endif
+#ifndef BATCH_MAX_FILE_BYTES
+#define BATCH_MAX_FILE_BYTES  (16 * 1024)
+#endif
+
+/* Distinguishes batches opened within the same second. */
+static unsigned int batch_sequence = 0;
+
+void upload_batch_init(upload_batch_t* batch) {
+  batch->request = NULL;
+  batch->num_bytes = 0;
+  batch->opened = 0;
+}
+
+void upload_batch_destroy(upload_batch_t* batch) {
+  if (batch->request != NULL) {
+    upload_request_free(batch->request);
+  }
+  upload_batch_init(batch);
+}
+
+static const char* base_name(const char* filename) {
+  const char* slash = strrchr(filename, '/');
+  return slash == NULL ? filename : slash + 1;
+}
+
+int upload_batch_accepts(const char* filename, off_t size) {
+  return size >= 0
+      && size <= BATCH_MAX_FILE_BYTES
+      && strlen(base_name(filename)) <= TAR_MAX_NAME_LENGTH;
+}
+
+int upload_batch_add(upload_batch_t* batch,
+                     const char* directory_path,
+                     const char* directory,
+                     int index,
+                     const char* filename,
+                     off_t size,
+                     time_t current_time) {
+  if (batch->request == NULL) {
+    /* current_time is monotonic; name archives after the wall clock so the
+     * names stay unique across reboots. */
+    char archive_name[PATH_MAX + 1];
+    snprintf(archive_name,
+             sizeof(archive_name),
+             "%s/batch-%ld-%u.tar",
+             directory_path,
+             (long)time(NULL),
+             batch_sequence++);
+    batch->request = upload_request_new(archive_name, directory, index, 1);
+    if (batch->request == NULL) {
+      return -1;
+    }
+    batch->num_bytes = 0;
+    batch->opened = current_time;
+  }
+  if (upload_request_add_member(batch->request, filename)) {
+    /* Don't leave an empty archive behind to be uploaded. */
+    if (batch->request->num_members == 0) {
+      upload_request_free(batch->request);
+      upload_batch_init(batch);
+    }
+    return -1;
+  }
+  /* Account for the tar header and padding each member costs. */
+  batch->num_bytes += TAR_BLOCK_SIZE
+      + (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+  return batch->request->num_members >= BATCH_MAX_FILES
+      || batch->num_bytes >= BATCH_MAX_BYTES;
+}
+
+upload_request_t* upload_batch_take(upload_batch_t* batch) {
+  upload_request_t* request = batch->request;
+  if (request != NULL) {
+    syslog(LOG_INFO,
+           "Batching %d files into %s",
+           request->num_members,
+           request->filename);
+  }
+  upload_batch_init(batch);
+  return request;
+}
+
+time_t upload_batch_deadline(const upload_batch_t* batch) {
+  if (batch->request == NULL) {
+    return -1;
+  }
+  return batch->opened + BATCH_WINDOW_SECONDS;
+}
@@ -0,0 +1,45 @@
+#ifndef _BISMARK_DATA_TRANSMIT_UPLOAD_BATCH_H_
+#define _BISMARK_DATA_TRANSMIT_UPLOAD_BATCH_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "upload_engine.h"
+
+/* Collects small files from one upload directory into a single archive
+ * request. A batch is flushed when it holds BATCH_MAX_FILES files or
+ * BATCH_MAX_BYTES of archive, or BATCH_WINDOW_SECONDS after its first
+ * file arrived, whichever comes first. */
+typedef struct {
+  upload_request_t* request;  /* The open batch, or NULL. */
+  off_t num_bytes;
+  time_t opened;
+} upload_batch_t;
+
+void upload_batch_init(upload_batch_t* batch);
+void upload_batch_destroy(upload_batch_t* batch);
+
+/* Return 1 if a file is small enough, and its name short enough, to be
+ * archived, and 0 if it should be uploaded on its own. */
+int upload_batch_accepts(const char* filename, off_t size);
+
+/* Add a file to the batch, opening one if needed. directory_path is the
+ * absolute path of the upload directory and current_time is on the monotonic
+ * clock. Return 1 if the batch is now full
+ * and should be flushed, 0 if not, and -1 on error. */
+int upload_batch_add(upload_batch_t* batch,
+                     const char* directory_path,
+                     const char* directory,
+                     int index,
+                     const char* filename,
+                     off_t size,
+                     time_t current_time);
+
+/* Close the batch and return its request, or NULL if it's empty. The caller
+ * owns the request. */
+upload_request_t* upload_batch_take(upload_batch_t* batch);
+
+/* When the open batch must be flushed, or -1 if there is no open batch. */
+time_t upload_batch_deadline(const upload_batch_t* batch);
+
+#endif
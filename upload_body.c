@@ -0,0 +1,548 @@
+#include "upload_body.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define MANIFEST_NAME  "MANIFEST"
+
+/* Compressor memory is bounded by these: deflate needs about
+ * 2^(GZIP_WINDOW_BITS + 2) + 2^(GZIP_MEMORY_LEVEL + 9) bytes (96 KB), and
+ * zstd's window is 2^ZSTD_WINDOW_LOG bytes. */
+#define GZIP_LEVEL  6
+#define GZIP_WINDOW_BITS  14
+#define GZIP_MEMORY_LEVEL  6
+#define ZSTD_LEVEL  3
+#define ZSTD_WINDOW_LOG  17
+/* Files that fit in the kernel's default readahead window gain nothing from
+ * a sequential access hint, so they are spared the extra syscall. */
+#define SEQUENTIAL_ADVICE_MIN_SIZE  (128 * 1024)
+
+enum {
+  PHASE_HEADER,
+  PHASE_DATA,
+  PHASE_PADDING
+};
+
+static void close_member(upload_body_t* body) {
+  if (body->fd >= 0) {
+    close(body->fd);
+    body->fd = -1;
+  }
+}
+
+static off_t tar_padding(off_t size) {
+  return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+static const char* base_name(const char* filename) {
+  const char* slash = strrchr(filename, '/');
+  return slash == NULL ? filename : slash + 1;
+}
+
+/* Fill in a ustar header for a regular file. */
+static void build_tar_header(char* header,
+                             const char* name,
+                             off_t size,
+                             time_t last_modified) {
+  memset(header, '\0', TAR_BLOCK_SIZE);
+  strncpy(header, name, TAR_MAX_NAME_LENGTH);
+  snprintf(header + 100, 8, "%07o", 0644);
+  snprintf(header + 108, 8, "%07o", 0);
+  snprintf(header + 116, 8, "%07o", 0);
+  snprintf(header + 124, 12, "%011llo", (unsigned long long)size);
+  snprintf(header + 136, 12, "%011llo", (unsigned long long)last_modified);
+  memset(header + 148, ' ', 8);
+  header[156] = '0';
+  memcpy(header + 257, "ustar", 6);
+  memcpy(header + 263, "00", 2);
+
+  unsigned int checksum = 0;
+  int idx;
+  for (idx = 0; idx < TAR_BLOCK_SIZE; ++idx) {
+    checksum += (unsigned char)header[idx];
+  }
+  snprintf(header + 148, 7, "%06o", checksum);
+  header[155] = ' ';
+}
+
+static int build_manifest(upload_body_t* body) {
+  size_t length = 0;
+  int idx;
+  for (idx = 0; idx < body->num_members; ++idx) {
+    const upload_member_t* member = &body->members[idx];
+    if (member->size >= 0) {
+      length += snprintf(NULL, 0, "%lld %ld %s\n",
+                         (long long)member->size,
+                         (long)member->last_modified,
+                         member->filename);
+    }
+  }
+  body->manifest = malloc(length + 1);
+  if (body->manifest == NULL) {
+    syslog(LOG_ERR, "build_manifest:malloc: %s", strerror(errno));
+    return -1;
+  }
+  size_t offset = 0;
+  for (idx = 0; idx < body->num_members; ++idx) {
+    const upload_member_t* member = &body->members[idx];
+    if (member->size >= 0) {
+      offset += snprintf(body->manifest + offset, length + 1 - offset,
+                         "%lld %ld %s\n",
+                         (long long)member->size,
+                         (long)member->last_modified,
+                         member->filename);
+    }
+  }
+  body->manifest_length = length;
+  return 0;
+}
+
+static void begin_entry(upload_body_t* body, int entry) {
+  body->entry = entry;
+  body->phase = body->archive ? PHASE_HEADER : PHASE_DATA;
+  body->offset = 0;
+}
+
+const char* upload_encoding_name(upload_encoding_t encoding) {
+  switch (encoding) {
+    case UPLOAD_ENCODING_GZIP:
+      return "gzip";
+    case UPLOAD_ENCODING_ZSTD:
+      return "zstd";
+    default:
+      return NULL;
+  }
+}
+
+int upload_encoding_parse(const char* name, upload_encoding_t* encoding) {
+  if (!strcmp(name, "none") || !strcmp(name, "identity")) {
+    *encoding = UPLOAD_ENCODING_IDENTITY;
+  } else if (!strcmp(name, "gzip")) {
+    *encoding = UPLOAD_ENCODING_GZIP;
+  } else if (!strcmp(name, "zstd")) {
+#ifdef HAVE_ZSTD
+    *encoding = UPLOAD_ENCODING_ZSTD;
+#else
+    syslog(LOG_WARNING, "Built without zstd support; using gzip instead");
+    *encoding = UPLOAD_ENCODING_GZIP;
+#endif
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int open_compressor(upload_body_t* body) {
+  void* input;
+  int rc = posix_memalign(&input, sysconf(_SC_PAGESIZE), UPLOAD_BODY_INPUT_SIZE);
+  if (rc) {
+    syslog(LOG_ERR, "open_compressor:posix_memalign: %s", strerror(rc));
+    return -1;
+  }
+  body->input = input;
+  if (body->encoding == UPLOAD_ENCODING_GZIP) {
+    z_stream* stream = malloc(sizeof(*stream));
+    if (stream == NULL) {
+      syslog(LOG_ERR, "open_compressor:malloc: %s", strerror(errno));
+      return -1;
+    }
+    memset(stream, '\0', sizeof(*stream));
+    /* Adding 16 to the window bits asks zlib for a gzip wrapper. */
+    rc = deflateInit2(stream,
+                          GZIP_LEVEL,
+                          Z_DEFLATED,
+                          GZIP_WINDOW_BITS + 16,
+                          GZIP_MEMORY_LEVEL,
+                          Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) {
+      syslog(LOG_ERR, "open_compressor:deflateInit2: %d", rc);
+      free(stream);
+      return -1;
+    }
+    body->compressor = stream;
+#ifdef HAVE_ZSTD
+  } else if (body->encoding == UPLOAD_ENCODING_ZSTD) {
+    ZSTD_CCtx* context = ZSTD_createCCtx();
+    if (context == NULL) {
+      syslog(LOG_ERR, "open_compressor:ZSTD_createCCtx");
+      return -1;
+    }
+    ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+    ZSTD_CCtx_setParameter(context, ZSTD_c_windowLog, ZSTD_WINDOW_LOG);
+    body->compressor = context;
+#endif
+  }
+  return 0;
+}
+
+static void close_compressor(upload_body_t* body) {
+  if (body->compressor != NULL) {
+    if (body->encoding == UPLOAD_ENCODING_GZIP) {
+      deflateEnd(body->compressor);
+      free(body->compressor);
+#ifdef HAVE_ZSTD
+    } else if (body->encoding == UPLOAD_ENCODING_ZSTD) {
+      ZSTD_freeCCtx(body->compressor);
+#endif
+    }
+    body->compressor = NULL;
+  }
+  free(body->input);
+  body->input = NULL;
+}
+
+/* The name to look a member up by relative to directory_fd, or NULL to use
+ * its absolute path. */
+static const char* relative_name(const upload_body_t* body,
+                                 const char* filename) {
+  const char* slash = strrchr(filename, '/');
+  return body->directory_fd >= 0 && slash != NULL ? slash + 1 : NULL;
+}
+
+static int open_member(const upload_body_t* body, const char* filename) {
+  const char* name = relative_name(body, filename);
+  return name != NULL
+      ? openat(body->directory_fd, name, O_RDONLY | O_CLOEXEC)
+      : open(filename, O_RDONLY | O_CLOEXEC);
+}
+
+static int stat_member(const upload_body_t* body,
+                       const char* filename,
+                       struct stat* file_info) {
+  const char* name = relative_name(body, filename);
+  return name != NULL
+      ? fstatat(body->directory_fd, name, file_info, 0)
+      : stat(filename, file_info);
+}
+
+int upload_body_open(upload_body_t* body,
+                     upload_member_t* members,
+                     int num_members,
+                     int directory_fd,
+                     int archive,
+                     upload_encoding_t encoding) {
+  memset(body, '\0', sizeof(*body));
+  body->members = members;
+  body->num_members = num_members;
+  body->directory_fd = directory_fd;
+  body->archive = archive;
+  body->encoding = encoding;
+  body->fd = -1;
+
+  int num_present = 0;
+  int idx;
+  for (idx = 0; idx < num_members; ++idx) {
+    upload_member_t* member = &members[idx];
+    struct stat file_info;
+    int result;
+    if (archive) {
+      result = stat_member(body, member->filename, &file_info);
+    } else {
+      /* A plain body's only member is opened once: its fstat() supplies the
+       * length and the same fd is read from. */
+      body->fd = open_member(body, member->filename);
+      result = body->fd < 0 ? -1 : fstat(body->fd, &file_info);
+    }
+    if (result) {
+      member->error = errno;
+      syslog(member->error == ENOENT ? LOG_INFO : LOG_ERR,
+             "upload_body_open:stat(\"%s\"): %s",
+             member->filename,
+             strerror(member->error));
+      close_member(body);
+      member->size = -1;
+      continue;
+    }
+    member->size = file_info.st_size;
+    member->error = 0;
+    member->last_modified = file_info.st_mtime;
+    member->device = file_info.st_dev;
+    member->inode = file_info.st_ino;
+    ++num_present;
+  }
+  if (num_present == 0) {
+    return -1;
+  }
+
+  if (archive) {
+    if (build_manifest(body)) {
+      return -1;
+    }
+    body->length = TAR_BLOCK_SIZE
+        + body->manifest_length + tar_padding(body->manifest_length)
+        + 2 * TAR_BLOCK_SIZE;
+    for (idx = 0; idx < num_members; ++idx) {
+      if (members[idx].size >= 0) {
+        body->length += TAR_BLOCK_SIZE
+            + members[idx].size + tar_padding(members[idx].size);
+      }
+    }
+    begin_entry(body, -1);
+  } else {
+    body->length = members[0].size;
+    begin_entry(body, 0);
+  }
+  if (encoding != UPLOAD_ENCODING_IDENTITY && open_compressor(body)) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Read from the current member at the current offset. */
+static ssize_t read_member(upload_body_t* body, char* buffer, size_t length) {
+  const upload_member_t* member = &body->members[body->entry];
+  const char* filename = member->filename;
+  if (body->fd < 0) {
+    body->fd = open_member(body, filename);
+    if (body->fd < 0) {
+      syslog(LOG_ERR,
+             "upload_body_read:open(\"%s\"): %s",
+             filename,
+             strerror(errno));
+      return -1;
+    }
+    /* Archive members are opened by name long after they were stat()ed for
+     * the manifest; make sure it is still the same file. */
+    struct stat file_info;
+    if (fstat(body->fd, &file_info)) {
+      syslog(LOG_ERR,
+             "upload_body_read:fstat(\"%s\"): %s",
+             filename,
+             strerror(errno));
+      return -1;
+    }
+    if (file_info.st_dev != member->device
+        || file_info.st_ino != member->inode) {
+      syslog(LOG_ERR, "upload_body_read:\"%s\" was replaced", filename);
+      return -1;
+    }
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (body->offset == 0
+      && body->members[body->entry].size >= SEQUENTIAL_ADVICE_MIN_SIZE) {
+    posix_fadvise(body->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+#endif
+  ssize_t result;
+  do {
+    result = pread(body->fd, buffer, length, body->offset);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) {
+    syslog(LOG_ERR,
+           "upload_body_read:pread(\"%s\"): %s",
+           filename,
+           strerror(errno));
+  } else if (result == 0) {
+    /* The file shrank since it was stat()ed, so the length we promised
+     * cURL is wrong. Give up and retry it later. */
+    syslog(LOG_ERR, "upload_body_read:pread(\"%s\"): short read", filename);
+    result = -1;
+  }
+  return result;
+}
+
+void upload_body_close(upload_body_t* body) {
+  close_member(body);
+  free(body->manifest);
+  body->manifest = NULL;
+  close_compressor(body);
+}
+
+off_t upload_body_length(const upload_body_t* body) {
+  return body->encoding == UPLOAD_ENCODING_IDENTITY ? body->length : -1;
+}
+
+static off_t entry_size(const upload_body_t* body) {
+  return body->entry < 0
+      ? (off_t)body->manifest_length : body->members[body->entry].size;
+}
+
+/* Produce up to capacity bytes of the uncompressed body. Return the number
+ * of bytes produced, 0 at the end of the body, or -1 on error. */
+static ssize_t read_raw(upload_body_t* body, char* buffer, size_t capacity) {
+  size_t written = 0;
+  while (written < capacity) {
+    size_t available = capacity - written;
+    if (body->entry >= body->num_members) {
+      /* The end of an archive is marked by two zero blocks. */
+      off_t remaining = body->archive ? 2 * TAR_BLOCK_SIZE - body->offset : 0;
+      if (remaining <= 0) {
+        break;
+      }
+      size_t chunk = remaining < (off_t)available ? remaining : available;
+      memset(buffer + written, '\0', chunk);
+      written += chunk;
+      body->offset += chunk;
+      continue;
+    }
+    if (body->entry >= 0 && body->members[body->entry].size < 0) {
+      begin_entry(body, body->entry + 1);
+      continue;
+    }
+
+    off_t remaining;
+    size_t chunk;
+    switch (body->phase) {
+      case PHASE_HEADER:
+        if (body->offset == 0) {
+          if (body->entry < 0) {
+            build_tar_header(
+                body->header, MANIFEST_NAME, body->manifest_length, time(NULL));
+          } else {
+            const upload_member_t* member = &body->members[body->entry];
+            build_tar_header(body->header,
+                             base_name(member->filename),
+                             member->size,
+                             member->last_modified);
+          }
+        }
+        remaining = TAR_BLOCK_SIZE - body->offset;
+        chunk = remaining < (off_t)available ? remaining : available;
+        memcpy(buffer + written, body->header + body->offset, chunk);
+        written += chunk;
+        body->offset += chunk;
+        if (body->offset == TAR_BLOCK_SIZE) {
+          body->phase = PHASE_DATA;
+          body->offset = 0;
+        }
+        break;
+
+      case PHASE_DATA:
+        remaining = entry_size(body) - body->offset;
+        chunk = remaining < (off_t)available ? remaining : available;
+        if (body->entry < 0) {
+          memcpy(buffer + written, body->manifest + body->offset, chunk);
+        } else if (chunk > 0) {
+          ssize_t length = read_member(body, buffer + written, chunk);
+          if (length < 0) {
+            return -1;
+          }
+          chunk = length;
+        }
+        written += chunk;
+        body->offset += chunk;
+        if (body->offset == entry_size(body)) {
+          close_member(body);
+          body->phase = PHASE_PADDING;
+          body->offset = 0;
+        }
+        break;
+
+      case PHASE_PADDING:
+        remaining = (body->archive ? tar_padding(entry_size(body)) : 0)
+            - body->offset;
+        chunk = remaining < (off_t)available ? remaining : available;
+        memset(buffer + written, '\0', chunk);
+        written += chunk;
+        body->offset += chunk;
+        if ((off_t)chunk == remaining) {
+          begin_entry(body, body->entry + 1);
+        }
+        break;
+    }
+  }
+  return written;
+}
+
+/* Refill the compressor's input from the raw body when it runs dry. */
+static int fill_input(upload_body_t* body) {
+  if (body->input_offset < body->input_length || body->input_done) {
+    return 0;
+  }
+  ssize_t length = read_raw(body, body->input, UPLOAD_BODY_INPUT_SIZE);
+  if (length < 0) {
+    return -1;
+  }
+  body->input_offset = 0;
+  body->input_length = length;
+  body->input_done = length == 0;
+  return 0;
+}
+
+static ssize_t read_gzip(upload_body_t* body, char* buffer, size_t capacity) {
+  z_stream* stream = body->compressor;
+  stream->next_out = (Bytef*)buffer;
+  stream->avail_out = capacity;
+  /* Keep feeding deflate until it has something to say; returning 0 to cURL
+   * would end the upload. */
+  while (stream->avail_out == capacity && !body->output_done) {
+    if (fill_input(body)) {
+      return -1;
+    }
+    stream->next_in = (Bytef*)body->input + body->input_offset;
+    stream->avail_in = body->input_length - body->input_offset;
+    int rc = deflate(stream, body->input_done ? Z_FINISH : Z_NO_FLUSH);
+    if (rc == Z_STREAM_END) {
+      body->output_done = 1;
+    } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+      syslog(LOG_ERR, "read_gzip:deflate: %d", rc);
+      return -1;
+    }
+    body->input_offset = body->input_length - stream->avail_in;
+  }
+  return capacity - stream->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+static ssize_t read_zstd(upload_body_t* body, char* buffer, size_t capacity) {
+  ZSTD_outBuffer output = { buffer, capacity, 0 };
+  while (output.pos == 0 && !body->output_done) {
+    if (fill_input(body)) {
+      return -1;
+    }
+    ZSTD_inBuffer input = {
+      body->input + body->input_offset,
+      body->input_length - body->input_offset,
+      0
+    };
+    size_t remaining = ZSTD_compressStream2(
+        body->compressor,
+        &output,
+        &input,
+        body->input_done ? ZSTD_e_end : ZSTD_e_continue);
+    if (ZSTD_isError(remaining)) {
+      syslog(LOG_ERR,
+             "read_zstd:ZSTD_compressStream2: %s",
+             ZSTD_getErrorName(remaining));
+      return -1;
+    }
+    body->input_offset += input.pos;
+    if (body->input_done && remaining == 0) {
+      body->output_done = 1;
+    }
+  }
+  return output.pos;
+}
+#endif
+
+size_t upload_body_read(char* buffer, size_t size, size_t nitems, void* userdata) {
+  upload_body_t* body = userdata;
+  size_t capacity = size * nitems;
+  ssize_t length;
+  switch (body->encoding) {
+    case UPLOAD_ENCODING_GZIP:
+      length = read_gzip(body, buffer, capacity);
+      break;
+#ifdef HAVE_ZSTD
+    case UPLOAD_ENCODING_ZSTD:
+      length = read_zstd(body, buffer, capacity);
+      break;
+#endif
+    default:
+      length = read_raw(body, buffer, capacity);
+      break;
+  }
+  return length < 0 ? CURL_READFUNC_ABORT : (size_t)length;
+}
@@ -0,0 +1,101 @@
+#ifndef _BISMARK_DATA_TRANSMIT_UPLOAD_BODY_H_
+#define _BISMARK_DATA_TRANSMIT_UPLOAD_BODY_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define TAR_BLOCK_SIZE  512
+#define TAR_MAX_NAME_LENGTH  100
+#define UPLOAD_BODY_INPUT_SIZE  65536
+
+/* Content-Encoding applied to a body as it is streamed. */
+typedef enum {
+  UPLOAD_ENCODING_IDENTITY,
+  UPLOAD_ENCODING_GZIP,
+  UPLOAD_ENCODING_ZSTD
+} upload_encoding_t;
+
+/* One file contributing to an upload body. size is -1 for members that
+ * couldn't be opened, with error the errno saying why; they are left out
+ * of the body.
+ * device and inode identify the file that was sent, which may no longer be
+ * the one called filename. */
+typedef struct {
+  char* filename;
+  off_t size;
+  int error;
+  time_t last_modified;
+  dev_t device;
+  ino_t inode;
+} upload_member_t;
+
+/* Streams the bytes of an upload to cURL. A plain body is the contents of its
+ * single member. An archive body is a ustar archive whose first entry is a
+ * MANIFEST listing "<size> <mtime> <filename>" for every member, followed by
+ * the members themselves under their base names. Only one member file is
+ * open at a time and nothing is buffered beyond a tar header. File contents
+ * are pread() straight into cURL's buffer rather than through stdio.
+ *
+ * Encoded bodies are compressed on the fly through a fixed size, page aligned
+ * input buffer, so their length isn't known in advance. */
+typedef struct {
+  upload_member_t* members;
+  int num_members;
+  /* The members' directory, or -1 to open them by their absolute paths. */
+  int directory_fd;
+  int archive;
+  upload_encoding_t encoding;
+  off_t length;
+
+  char* manifest;
+  size_t manifest_length;
+
+  /* Read position: current entry (-1 for the manifest, num_members for the
+   * end-of-archive trailer), the phase within that entry, and the byte
+   * offset within that phase. */
+  int entry;
+  int phase;
+  off_t offset;
+  /* The member being read, or -1. */
+  int fd;
+  char header[TAR_BLOCK_SIZE];
+
+  /* Compressor state, and uncompressed bytes waiting to be compressed. */
+  void* compressor;
+  char* input;
+  size_t input_offset;
+  size_t input_length;
+  int input_done;
+  int output_done;
+} upload_body_t;
+
+/* The Content-Encoding token for an encoding, or NULL for identity. */
+const char* upload_encoding_name(upload_encoding_t encoding);
+
+/* Parse "none", "gzip" or "zstd". zstd falls back to gzip when the daemon was
+ * built without it. */
+int upload_encoding_parse(const char* name, upload_encoding_t* encoding);
+
+/* Prepare to stream members. Members are stat()ed to learn their sizes;
+ * ones that can't be are skipped. A plain body's member is opened right away
+ * and fstat()ed instead, and stays open for reading. Members are looked up
+ * by base name relative to directory_fd unless it is -1. Returns -1 if
+ * nothing is left to send. */
+int upload_body_open(upload_body_t* body,
+                     upload_member_t* members,
+                     int num_members,
+                     int directory_fd,
+                     int archive,
+                     upload_encoding_t encoding);
+void upload_body_close(upload_body_t* body);
+
+/* Total number of bytes upload_body_read() will produce, or -1 if the body
+ * is compressed and its length is unknown. */
+off_t upload_body_length(const upload_body_t* body);
+
+/* CURLOPT_READFUNCTION callback; userdata is an upload_body_t. */
+size_t upload_body_read(char* buffer, size_t size, size_t nitems, void* userdata);
+
+#endif
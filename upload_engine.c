@@ -0,0 +1,1090 @@
+#include "upload_engine.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+
+#include "monotonic.h"
+
+#ifndef BUILD_ID
+#define BUILD_ID  "git"
+#endif
+/* Size of the buffer cURL asks the read callback to fill. Bigger buffers
+ * mean fewer callbacks and pread()s per upload. */
+#ifndef UPLOAD_BUFFER_SIZE
+#define UPLOAD_BUFFER_SIZE  131072
+#endif
+#define MAX_URL_LENGTH  2000
+/* A rate limited transfer waits until it may send at least this many bytes
+ * (or a whole burst, if that is less), rather than trickling out tiny
+ * reads. */
+#ifndef RATE_LIMIT_QUANTUM
+#define RATE_LIMIT_QUANTUM  8192
+#endif
+
+/* HTTP/2 multiplexing needs CURLPIPE_MULTIPLEX, CURLOPT_PIPEWAIT and
+ * CURL_HTTP_VERSION_2TLS, the last of which arrived in cURL 7.47.0. */
+#if defined(HTTP2) && LIBCURL_VERSION_NUM >= 0x072f00
+#define USE_HTTP2
+#endif
+
+/* The limit on a request's directory, or NULL if it has none. */
+static token_bucket_t* directory_limit(upload_engine_t* engine,
+                                       const upload_request_t* request) {
+  if (request->index < 0 || request->index >= engine->num_directory_limits) {
+    return NULL;
+  }
+  token_bucket_t* bucket = &engine->directory_limits[request->index];
+  return bucket->rate > 0 ? bucket : NULL;
+}
+
+static size_t quantum(const token_bucket_t* bucket) {
+  return bucket->burst < RATE_LIMIT_QUANTUM ? bucket->burst : RATE_LIMIT_QUANTUM;
+}
+
+/* Return 1 if a paused transfer of higher priority than request waits only
+ * for the shared limit, and so has first claim on its tokens. */
+static int outranked(upload_engine_t* engine,
+                     const upload_request_t* request,
+                     int64_t current_time) {
+  int idx;
+  for (idx = 0; idx < engine->max_transfers; ++idx) {
+    const upload_transfer_t* other = &engine->transfers[idx];
+    if (other->paused && other->request->priority > request->priority) {
+      token_bucket_t* other_limit = directory_limit(engine, other->request);
+      if (other_limit == NULL
+          || token_bucket_available(other_limit, current_time)
+             >= quantum(other_limit)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* How many bytes a transfer may send now. If none, *ready_time is when it
+ * may try again. */
+static size_t transfer_allowance(upload_engine_t* engine,
+                                 upload_transfer_t* transfer,
+                                 int64_t current_time,
+                                 int64_t* ready_time) {
+  token_bucket_t* limits[2];
+  limits[0] = engine->limit.rate > 0 ? &engine->limit : NULL;
+  limits[1] = directory_limit(engine, transfer->request);
+  size_t allowance = SIZE_MAX;
+  *ready_time = current_time;
+  int idx;
+  for (idx = 0; idx < 2; ++idx) {
+    if (limits[idx] == NULL) {
+      continue;
+    }
+    size_t available = token_bucket_available(limits[idx], current_time);
+    if (available < quantum(limits[idx])) {
+      int64_t limit_ready = token_bucket_ready_time(
+          limits[idx], quantum(limits[idx]), current_time);
+      if (limit_ready > *ready_time) {
+        *ready_time = limit_ready;
+      }
+      available = 0;
+    }
+    if (available < allowance) {
+      allowance = available;
+    }
+  }
+  if (allowance > 0
+      && limits[0] != NULL
+      && outranked(engine, transfer->request, current_time)) {
+    /* Try again once the higher priority transfers have been resumed. */
+    allowance = 0;
+  }
+  return allowance;
+}
+
+/* CURLOPT_READFUNCTION: read the body within the rate limits, pausing the
+ * transfer when they allow nothing. */
+static size_t read_transfer(char* buffer,
+                            size_t size,
+                            size_t nitems,
+                            void* userdata) {
+  upload_transfer_t* transfer = userdata;
+  upload_engine_t* engine = transfer->engine;
+  token_bucket_t* limit = directory_limit(engine, transfer->request);
+  if (engine->limit.rate == 0 && limit == NULL) {
+    return upload_body_read(buffer, size, nitems, &transfer->body);
+  }
+  int64_t current_time = monotonic_milliseconds();
+  int64_t ready_time;
+  size_t length = size * nitems;
+  size_t allowance = transfer_allowance(
+      engine, transfer, current_time, &ready_time);
+  if (allowance < length) {
+    transfer->request->throttled = 1;
+  }
+  if (allowance == 0) {
+    transfer->paused = 1;
+    transfer->paused_at = current_time;
+    if (engine->resume_deadline < 0 || ready_time < engine->resume_deadline) {
+      engine->resume_deadline = ready_time;
+    }
+    return CURL_READFUNC_PAUSE;
+  }
+  if (length > allowance) {
+    length = allowance;
+  }
+  size_t result = upload_body_read(buffer, 1, length, &transfer->body);
+  if (result != CURL_READFUNC_ABORT) {
+    token_bucket_take(&engine->limit, result);
+    if (limit != NULL) {
+      token_bucket_take(limit, result);
+    }
+  }
+  return result;
+}
+
+/* Apply the options shared by every upload to a fresh easy handle. */
+static int initialize_transfer(upload_transfer_t* transfer) {
+  transfer->curl_handle = curl_easy_init();
+  if (!transfer->curl_handle) {
+    syslog(LOG_ERR, "initialize_transfer:curl_easy_init");
+    return -1;
+  }
+  CURL* curl_handle = transfer->curl_handle;
+  int rc = curl_easy_setopt(
+      curl_handle, CURLOPT_ERRORBUFFER, transfer->error_message);
+  if (rc) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_ERRORBUFFER): %s",
+           curl_easy_strerror(rc));
+    return -1;
+  }
+  if (curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, transfer)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_PRIVATE): %s",
+           transfer->error_message);
+    return -1;
+  }
+  if (curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, read_transfer)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_READFUNCTION): %s",
+           transfer->error_message);
+    return -1;
+  }
+  if (curl_easy_setopt(curl_handle, CURLOPT_READDATA, transfer)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_READDATA): %s",
+           transfer->error_message);
+    return -1;
+  }
+#ifdef DEBUG_MESSAGES
+  if (curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_VERBOSE): %s",
+           transfer->error_message);
+    return -1;
+  }
+#endif
+  /* CURLOPT_UPLOAD uses HTTP PUT by default. */
+  if (curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1L)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_UPLOAD): %s",
+           transfer->error_message);
+    return -1;
+  }
+#if LIBCURL_VERSION_NUM >= 0x073e00
+  if (curl_easy_setopt(curl_handle, CURLOPT_UPLOAD_BUFFERSIZE, (long)UPLOAD_BUFFER_SIZE)) {
+    syslog(LOG_WARNING,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_UPLOAD_BUFFERSIZE, %d): %s",
+           UPLOAD_BUFFER_SIZE,
+           transfer->error_message);
+  }
+#endif
+  /* Make cURL return an error if the Web server returns an HTTP error code. */
+  if (curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_FAILONERROR): %s",
+           transfer->error_message);
+    return -1;
+  }
+#ifdef USE_HTTP2
+  /* Ask for h2 via ALPN. If the server doesn't negotiate it, cURL silently
+   * falls back to HTTP/1.1 on that connection. */
+  if (curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_HTTP_VERSION): %s",
+           transfer->error_message);
+    return -1;
+  }
+  /* Wait for an existing connection to say whether it can multiplex instead
+   * of opening a new connection for every stream. */
+  if (curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_PIPEWAIT): %s",
+           transfer->error_message);
+    return -1;
+  }
+  /* ALPN, and therefore h2, requires TLS 1.2. */
+  if (curl_easy_setopt(curl_handle, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_SSLVERSION): %s",
+           transfer->error_message);
+    return -1;
+  }
+#else
+  /* Newer cURL builds refuse SSLv3; fall back to the library default rather
+   * than failing every upload. Every slot gets the same answer, so only the
+   * first one reports it. */
+  rc = curl_easy_setopt(
+      curl_handle, CURLOPT_SSLVERSION, CURL_SSLVERSION_SSLv3);
+  if (rc && transfer == &transfer->engine->transfers[0]) {
+    syslog(LOG_WARNING,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_SSLVERSION): %s",
+           curl_easy_strerror(rc));
+  }
+#endif
+#ifdef SKIP_SSL_VERIFICATION
+  if (curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0)) {
+    syslog(LOG_ERR,
+           "initialize_transfer:curl_easy_setopt(CURLOPT_SSL_VERIFYPEER): %s",
+           transfer->error_message);
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/* CURLMOPT_SOCKETFUNCTION: keep the epoll set in step with what cURL wants
+ * to wait for on each socket. */
+static int handle_socket(CURL* curl_handle,
+                         curl_socket_t socket,
+                         int what,
+                         void* userdata,
+                         void* socket_data) {
+  upload_engine_t* engine = userdata;
+  if (what == CURL_POLL_REMOVE) {
+    /* The socket may already be closed, which removes it by itself. */
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+    return 0;
+  }
+  struct epoll_event event;
+  memset(&event, '\0', sizeof(event));
+  event.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0)
+      | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+  event.data.fd = socket;
+  if (epoll_ctl(engine->epoll_fd,
+                socket_data != NULL ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                socket,
+                &event)) {
+    syslog(LOG_ERR, "handle_socket:epoll_ctl(%d): %s", socket, strerror(errno));
+    return -1;
+  }
+  curl_multi_assign(engine->multi_handle, socket, engine);
+  return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: remember when cURL wants its timeout action. */
+static int handle_timer(CURLM* multi_handle, long timeout_ms, void* userdata) {
+  upload_engine_t* engine = userdata;
+  engine->deadline = timeout_ms < 0
+      ? -1 : monotonic_milliseconds() + timeout_ms;
+  return 0;
+}
+
+int upload_engine_init(upload_engine_t* engine,
+                       const char* uploads_url,
+                       const char* bismark_id,
+                       int max_transfers,
+                       upload_done_callback_t done_callback,
+                       int epoll_fd) {
+  memset(engine, '\0', sizeof(*engine));
+  engine->epoll_fd = epoll_fd;
+  engine->deadline = -1;
+  engine->resume_deadline = -1;
+  token_bucket_init(&engine->limit);
+  engine->uploads_url = uploads_url;
+  engine->bismark_id = bismark_id;
+  engine->done_callback = done_callback;
+  engine->max_transfers = max_transfers > 0 ? max_transfers : 1;
+  link_estimate_init(&engine->link, engine->max_transfers);
+
+  engine->multi_handle = curl_multi_init();
+  if (!engine->multi_handle) {
+    syslog(LOG_ERR, "upload_engine_init:curl_multi_init");
+    return -1;
+  }
+  if (curl_multi_setopt(engine->multi_handle,
+                        CURLMOPT_SOCKETFUNCTION,
+                        handle_socket) != CURLM_OK
+      || curl_multi_setopt(engine->multi_handle,
+                           CURLMOPT_SOCKETDATA,
+                           engine) != CURLM_OK
+      || curl_multi_setopt(engine->multi_handle,
+                           CURLMOPT_TIMERFUNCTION,
+                           handle_timer) != CURLM_OK
+      || curl_multi_setopt(engine->multi_handle,
+                           CURLMOPT_TIMERDATA,
+                           engine) != CURLM_OK) {
+    syslog(LOG_ERR, "upload_engine_init:curl_multi_setopt: socket callbacks");
+    upload_engine_destroy(engine);
+    return -1;
+  }
+#ifdef USE_HTTP2
+  CURLMcode multi_rc = curl_multi_setopt(
+      engine->multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  if (multi_rc != CURLM_OK) {
+    syslog(LOG_ERR,
+           "upload_engine_init:curl_multi_setopt(CURLMOPT_PIPELINING): %s",
+           curl_multi_strerror(multi_rc));
+    upload_engine_destroy(engine);
+    return -1;
+  }
+  syslog(LOG_INFO, "Multiplexing uploads over HTTP/2 when available");
+#elif defined(HTTP2)
+  syslog(LOG_WARNING, "cURL %s is too old for HTTP/2 uploads", LIBCURL_VERSION);
+#endif
+  engine->transfers = calloc(engine->max_transfers,
+                             sizeof(engine->transfers[0]));
+  if (engine->transfers == NULL) {
+    syslog(LOG_ERR, "upload_engine_init:calloc: %s", strerror(errno));
+    upload_engine_destroy(engine);
+    return -1;
+  }
+  int idx;
+  for (idx = 0; idx < engine->max_transfers; ++idx) {
+    engine->transfers[idx].engine = engine;
+    engine->transfers[idx].deadline = -1;
+    if (initialize_transfer(&engine->transfers[idx])) {
+      upload_engine_destroy(engine);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void upload_engine_destroy(upload_engine_t* engine) {
+  if (engine->transfers != NULL) {
+    int idx;
+    for (idx = 0; idx < engine->max_transfers; ++idx) {
+      upload_transfer_t* transfer = &engine->transfers[idx];
+      if (transfer->request != NULL) {
+        curl_multi_remove_handle(engine->multi_handle, transfer->curl_handle);
+        upload_body_close(&transfer->body);
+        curl_slist_free_all(transfer->headers);
+        upload_request_free(transfer->request);
+      }
+      if (transfer->curl_handle != NULL) {
+        curl_easy_cleanup(transfer->curl_handle);
+      }
+    }
+    free(engine->transfers);
+    engine->transfers = NULL;
+  }
+  while (engine->pending_head != NULL) {
+    upload_request_t* request = engine->pending_head;
+    engine->pending_head = request->next;
+    upload_request_free(request);
+  }
+  engine->pending_tail = NULL;
+  engine->num_pending = 0;
+  engine->num_active = 0;
+  free(engine->directory_limits);
+  engine->directory_limits = NULL;
+  engine->num_directory_limits = 0;
+  free(engine->directory_fds);
+  engine->directory_fds = NULL;
+  engine->num_directory_fds = 0;
+  if (engine->multi_handle != NULL) {
+    curl_multi_cleanup(engine->multi_handle);
+    engine->multi_handle = NULL;
+  }
+}
+
+/* Build the upload URL for a request. url must be at least MAX_URL_LENGTH
+ * bytes long. */
+static int build_url(upload_engine_t* engine,
+                     upload_transfer_t* transfer,
+                     char* url) {
+  CURL* curl_handle = transfer->curl_handle;
+  upload_request_t* request = transfer->request;
+  char* encoded_filename = curl_easy_escape(curl_handle, request->filename, 0);
+  if (encoded_filename == NULL) {
+    syslog(LOG_ERR,
+           "build_url:curl_easy_escape(\"%s\"): %s\n",
+           request->filename,
+           transfer->error_message);
+    return -1;
+  }
+  char* encoded_nodeid = curl_easy_escape(curl_handle, engine->bismark_id, 0);
+  if(encoded_nodeid == NULL) {
+    syslog(LOG_ERR,
+           "build_url:curl_easy_escape(\"%s\"): %s\n",
+           engine->bismark_id,
+           transfer->error_message);
+    curl_free(encoded_filename);
+    return -1;
+  }
+  char* encoded_buildid = curl_easy_escape(curl_handle, BUILD_ID, 0);
+  if(encoded_buildid == NULL) {
+    syslog(LOG_ERR,
+           "build_url:curl_easy_escape(\"%s\"): %s\n",
+           BUILD_ID,
+           transfer->error_message);
+    curl_free(encoded_filename);
+    curl_free(encoded_nodeid);
+    return -1;
+  }
+  char* encoded_directory = curl_easy_escape(
+      curl_handle, request->directory, 0);
+  if(encoded_directory == NULL) {
+    syslog(LOG_ERR,
+           "build_url:curl_easy_escape(\"%s\"): %s\n",
+           request->directory,
+           transfer->error_message);
+    curl_free(encoded_filename);
+    curl_free(encoded_nodeid);
+    curl_free(encoded_buildid);
+    return -1;
+  }
+  snprintf(url,
+           MAX_URL_LENGTH,
+           "%s?filename=%s&node_id=%s&build_id=%s&directory=%s%s",
+           engine->uploads_url,
+           encoded_filename,
+           encoded_nodeid,
+           encoded_buildid,
+           encoded_directory,
+           request->archive ? "&archive=tar" : "");
+  curl_free(encoded_filename);
+  curl_free(encoded_nodeid);
+  curl_free(encoded_buildid);
+  curl_free(encoded_directory);
+  return 0;
+}
+
+/* The rate in bytes per second a transfer of request can't exceed with
+ * concurrent transfers sharing the global limit, or 0 if it has no limit. */
+static size_t rate_limit(upload_engine_t* engine,
+                         const upload_request_t* request,
+                         int concurrent) {
+  size_t rate = engine->limit.rate / (concurrent > 0 ? concurrent : 1);
+  if (engine->limit.rate > 0 && rate == 0) {
+    rate = 1;
+  }
+  token_bucket_t* limit = directory_limit(engine, request);
+  if (limit != NULL) {
+    /* The directory's active transfers, this one included, share its
+     * limit. */
+    int sharing = 0;
+    int idx;
+    for (idx = 0; idx < engine->max_transfers; ++idx) {
+      const upload_request_t* other = engine->transfers[idx].request;
+      sharing += other != NULL && other->index == request->index;
+    }
+    size_t share = limit->rate / (sharing > 0 ? sharing : 1);
+    if (share == 0) {
+      share = 1;
+    }
+    if (rate == 0 || share < rate) {
+      rate = share;
+    }
+  }
+  return rate;
+}
+
+/* The body length, or for compressed bodies the total size of their
+ * members, which they are assumed not to exceed. */
+static off_t expected_length(const upload_body_t* body) {
+  off_t length = upload_body_length(body);
+  if (length < 0) {
+    length = 0;
+    int idx;
+    for (idx = 0; idx < body->num_members; ++idx) {
+      if (body->members[idx].size > 0) {
+        length += body->members[idx].size;
+      }
+    }
+  }
+  return length;
+}
+
+/* Set the timeouts and stall detection of a transfer from what is known
+ * about the link. The transfer's deadline stands in for CURLOPT_TIMEOUT,
+ * which would count the time the rate limits keep it paused. */
+static int set_timeouts(upload_engine_t* engine, upload_transfer_t* transfer) {
+  CURL* curl_handle = transfer->curl_handle;
+  int concurrent = engine->num_active + 1;
+  size_t rate = rate_limit(engine, transfer->request, concurrent);
+  long connect_timeout = link_estimate_connect_timeout(&engine->link);
+  if (curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, connect_timeout)) {
+    syslog(LOG_ERR,
+           "set_timeouts:curl_easy_setopt(CURLOPT_CONNECTTIMEOUT, %ld): %s",
+           connect_timeout,
+           transfer->error_message);
+    return -1;
+  }
+  long timeout = link_estimate_transfer_timeout(
+      &engine->link, expected_length(&transfer->body), concurrent, rate);
+  transfer->deadline = monotonic_milliseconds() + (int64_t)timeout * 1000;
+  /* A rate limited transfer is slow on purpose. The handles are reused, so
+   * always set both options. */
+  long low_speed_time = 0;
+  long low_speed_limit = 0;
+  if (rate == 0) {
+    low_speed_limit = link_estimate_low_speed_limit(
+        &engine->link, concurrent, &low_speed_time);
+  }
+  if (curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit)
+      || curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME, low_speed_time)) {
+    syslog(LOG_ERR,
+           "set_timeouts:curl_easy_setopt(CURLOPT_LOW_SPEED_LIMIT, %ld): %s",
+           low_speed_limit,
+           transfer->error_message);
+    return -1;
+  }
+  return 0;
+}
+
+/* Attach a request to an idle transfer slot and hand it to the multi handle.
+ * On failure the request is still owned by the transfer and the caller must
+ * finish it. */
+static int start_transfer(upload_engine_t* engine,
+                          upload_transfer_t* transfer,
+                          upload_request_t* request) {
+  transfer->request = request;
+  transfer->error_message[0] = '\0';
+
+  /* Determine the size of the body. (cURL needs to the know the size.) */
+  int directory_fd = -1;
+  if (request->index >= 0 && request->index < engine->num_directory_fds) {
+    directory_fd = engine->directory_fds[request->index];
+  }
+  if (upload_body_open(&transfer->body,
+                       request->members,
+                       request->num_members,
+                       directory_fd,
+                       request->archive,
+                       request->encoding)) {
+    return -1;
+  }
+  /* Compressed bodies have no length up front; -1 makes cURL use chunked
+   * transfer encoding on HTTP/1.1. */
+  curl_off_t body_length = upload_body_length(&transfer->body);
+
+  const char* encoding_name = upload_encoding_name(request->encoding);
+  if (encoding_name != NULL) {
+    char header[64];
+    snprintf(header, sizeof(header), "Content-Encoding: %s", encoding_name);
+    transfer->headers = curl_slist_append(NULL, header);
+    if (transfer->headers == NULL) {
+      syslog(LOG_ERR, "start_transfer:curl_slist_append");
+      return -1;
+    }
+  }
+  if (curl_easy_setopt(transfer->curl_handle, CURLOPT_HTTPHEADER, transfer->headers)) {
+    syslog(LOG_ERR,
+           "start_transfer:curl_easy_setopt(CURLOPT_HTTPHEADER): %s",
+           transfer->error_message);
+    return -1;
+  }
+
+  char url[MAX_URL_LENGTH];
+  if (build_url(engine, transfer, url)) {
+    return -1;
+  }
+  if (curl_easy_setopt(transfer->curl_handle, CURLOPT_URL, url)) {
+    syslog(LOG_ERR,
+           "start_transfer:curl_easy_setopt(CURLOPT_URL, \"%s\"): %s",
+           url,
+           transfer->error_message);
+    return -1;
+  }
+  if (curl_easy_setopt(transfer->curl_handle, CURLOPT_INFILESIZE_LARGE, body_length)) {
+    syslog(LOG_ERR,
+           "start_transfer:curl_easy_setopt(CURLOPT_INFILESIZE_LARGE, %lld): %s",
+           (long long)body_length,
+           transfer->error_message);
+    return -1;
+  }
+  if (set_timeouts(engine, transfer)) {
+    return -1;
+  }
+  CURLMcode rc = curl_multi_add_handle(engine->multi_handle,
+                                       transfer->curl_handle);
+  if (rc != CURLM_OK) {
+    syslog(LOG_ERR,
+           "start_transfer:curl_multi_add_handle: %s",
+           curl_multi_strerror(rc));
+    return -1;
+  }
+  ++engine->num_active;
+  return 0;
+}
+
+/* Release a transfer slot and report the outcome of its request. */
+static void finish_transfer(upload_engine_t* engine,
+                            upload_transfer_t* transfer,
+                            int succeeded) {
+  upload_request_t* request = transfer->request;
+  upload_body_close(&transfer->body);
+  curl_slist_free_all(transfer->headers);
+  transfer->headers = NULL;
+  transfer->request = NULL;
+  transfer->paused = 0;
+  transfer->deadline = -1;
+  engine->done_callback(request, succeeded);
+  upload_request_free(request);
+}
+
+/* Move pending requests into idle transfer slots, as many as the link can
+ * take. */
+static void start_pending(upload_engine_t* engine) {
+  int idx;
+  for (idx = 0;
+       idx < engine->max_transfers && engine->pending_head != NULL
+           && engine->num_active < link_estimate_concurrency(&engine->link);
+       ++idx) {
+    upload_transfer_t* transfer = &engine->transfers[idx];
+    if (transfer->request != NULL) {
+      continue;
+    }
+    upload_request_t* request = engine->pending_head;
+    engine->pending_head = request->next;
+    if (engine->pending_head == NULL) {
+      engine->pending_tail = NULL;
+    }
+    --engine->num_pending;
+    request->next = NULL;
+    if (start_transfer(engine, transfer, request)) {
+      finish_transfer(engine, transfer, 0);
+      --idx;  /* Retry this slot with the next pending request. */
+    }
+  }
+}
+
+upload_request_t* upload_request_new(const char* filename,
+                                     const char* directory,
+                                     int index,
+                                     int archive) {
+  upload_request_t* request = calloc(1, sizeof(*request));
+  if (request == NULL) {
+    syslog(LOG_ERR, "upload_request_new:calloc: %s", strerror(errno));
+    return NULL;
+  }
+  strncpy(request->filename, filename, PATH_MAX);
+  request->directory = directory;
+  request->index = index;
+  request->archive = archive;
+  request->result = CURLE_FAILED_INIT;
+  request->connect_time = -1;
+  request->round_trip_time = -1;
+  if (!archive && upload_request_add_member(request, filename)) {
+    upload_request_free(request);
+    return NULL;
+  }
+  return request;
+}
+
+int upload_request_add_member(upload_request_t* request, const char* filename) {
+  if (request->num_members >= request->members_capacity) {
+    int capacity = request->members_capacity ? request->members_capacity * 2 : 1;
+    void* new_members = realloc(request->members,
+                                capacity * sizeof(request->members[0]));
+    if (new_members == NULL) {
+      syslog(LOG_ERR, "upload_request_add_member:realloc: %s", strerror(errno));
+      return -1;
+    }
+    request->members = new_members;
+    request->members_capacity = capacity;
+  }
+  upload_member_t* member = &request->members[request->num_members];
+  member->filename = strdup(filename);
+  if (member->filename == NULL) {
+    syslog(LOG_ERR,
+           "upload_request_add_member:strdup(\"%s\"): %s",
+           filename,
+           strerror(errno));
+    return -1;
+  }
+  member->size = 0;
+  member->error = 0;
+  member->last_modified = 0;
+  ++request->num_members;
+  return 0;
+}
+
+void upload_request_free(upload_request_t* request) {
+  int idx;
+  for (idx = 0; idx < request->num_members; ++idx) {
+    free(request->members[idx].filename);
+  }
+  free(request->members);
+  free(request);
+}
+
+int upload_request_server_failed(const upload_request_t* request) {
+  switch (request->result) {
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+      return 1;
+    case CURLE_OPERATION_TIMEDOUT:
+      return !request->throttled;
+    case CURLE_HTTP_RETURNED_ERROR:
+      return request->response_code >= 500;
+    default:
+      return 0;
+  }
+}
+
+int upload_engine_enqueue(upload_engine_t* engine, upload_request_t* request) {
+  request->next = NULL;
+  if (engine->pending_tail == NULL) {
+    engine->pending_head = request;
+    engine->pending_tail = request;
+  } else if (engine->pending_tail->priority >= request->priority) {
+    engine->pending_tail->next = request;
+    engine->pending_tail = request;
+  } else {
+    /* Jump ahead of every lower priority request. */
+    upload_request_t** link = &engine->pending_head;
+    while ((*link)->priority >= request->priority) {
+      link = &(*link)->next;
+    }
+    request->next = *link;
+    *link = request;
+  }
+  ++engine->num_pending;
+
+  start_pending(engine);
+  return 0;
+}
+
+int upload_engine_submit(upload_engine_t* engine,
+                         const char* filename,
+                         const char* directory,
+                         int index,
+                         upload_encoding_t encoding,
+                         int priority) {
+  upload_request_t* request = upload_request_new(
+      filename, directory, index, 0);
+  if (request == NULL) {
+    return -1;
+  }
+  request->encoding = encoding;
+  request->priority = priority;
+  return upload_engine_enqueue(engine, request);
+}
+
+/* Fill in how long a finished transfer took and how much it sent. */
+static void record_timings(CURL* curl_handle, upload_request_t* request) {
+  long new_connections = 0;
+  (void)curl_easy_getinfo(
+      curl_handle, CURLINFO_NUM_CONNECTS, &new_connections);
+  if (new_connections > 0) {
+    double lookup_time = 0;
+    double connect_time = 0;
+    double tls_time = 0;
+    (void)curl_easy_getinfo(
+        curl_handle, CURLINFO_NAMELOOKUP_TIME, &lookup_time);
+    (void)curl_easy_getinfo(
+        curl_handle, CURLINFO_CONNECT_TIME, &connect_time);
+    /* APPCONNECT_TIME is 0 for plain HTTP. */
+    (void)curl_easy_getinfo(
+        curl_handle, CURLINFO_APPCONNECT_TIME, &tls_time);
+    request->connect_time = tls_time > 0 ? tls_time : connect_time;
+    /* The TCP handshake takes one round trip. */
+    if (connect_time > lookup_time) {
+      request->round_trip_time = connect_time - lookup_time;
+    }
+  }
+  (void)curl_easy_getinfo(
+      curl_handle, CURLINFO_TOTAL_TIME, &request->total_time);
+#if LIBCURL_VERSION_NUM >= 0x073700
+  (void)curl_easy_getinfo(
+      curl_handle, CURLINFO_SIZE_UPLOAD_T, &request->bytes_sent);
+  curl_off_t upload_speed = 0;
+  (void)curl_easy_getinfo(
+      curl_handle, CURLINFO_SPEED_UPLOAD_T, &upload_speed);
+  request->upload_speed = upload_speed;
+#else
+  double bytes_sent = 0;
+  (void)curl_easy_getinfo(curl_handle, CURLINFO_SIZE_UPLOAD, &bytes_sent);
+  request->bytes_sent = (curl_off_t)bytes_sent;
+  (void)curl_easy_getinfo(
+      curl_handle, CURLINFO_SPEED_UPLOAD, &request->upload_speed);
+#endif
+}
+
+/* Learn about the link from a finished transfer that was still active. */
+static void update_link_estimate(upload_engine_t* engine,
+                                 const upload_transfer_t* transfer) {
+  const upload_request_t* request = transfer->request;
+  int concurrency = link_estimate_concurrency(&engine->link);
+  if (request->result == CURLE_OK) {
+    /* A rate limited transfer says nothing about the link's speed. */
+    double speed = request->upload_speed;
+    if (request->throttled
+        || rate_limit(engine, request, engine->num_active) > 0) {
+      speed = 0;
+    }
+    link_estimate_success(&engine->link,
+                          request->bytes_sent,
+                          speed,
+                          engine->num_active,
+                          request->round_trip_time);
+  } else if (request->result == CURLE_OPERATION_TIMEDOUT
+             && !request->throttled) {
+    link_estimate_timeout(&engine->link);
+  }
+  if (link_estimate_concurrency(&engine->link) != concurrency) {
+    syslog(LOG_INFO,
+           "Running up to %d uploads at once (%.0f bytes/s, %.0f ms round trip)",
+           link_estimate_concurrency(&engine->link),
+           engine->link.throughput,
+           engine->link.round_trip_time * 1000);
+  }
+}
+
+/* Report the outcome of a transfer that has been removed from the multi
+ * handle. */
+static void complete_transfer(upload_engine_t* engine,
+                              upload_transfer_t* transfer,
+                              CURLcode result) {
+  CURL* curl_handle = transfer->curl_handle;
+  transfer->request->result = result;
+  curl_easy_getinfo(curl_handle,
+                    CURLINFO_RESPONSE_CODE,
+                    &transfer->request->response_code);
+  record_timings(curl_handle, transfer->request);
+  update_link_estimate(engine, transfer);
+  --engine->num_active;
+  if (result != CURLE_OK) {
+    syslog(LOG_ERR,
+           "complete_transfer:\"%s\": %s",
+           transfer->request->filename,
+           transfer->error_message[0] != '\0'
+               ? transfer->error_message : curl_easy_strerror(result));
+  }
+  finish_transfer(engine, transfer, result == CURLE_OK);
+}
+
+/* Report finished transfers and refill the idle slots. */
+static void finish_completed(upload_engine_t* engine) {
+  CURLMsg* message;
+  int messages_left;
+  while ((message = curl_multi_info_read(engine->multi_handle, &messages_left))) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    CURL* curl_handle = message->easy_handle;
+    CURLcode result = message->data.result;
+    upload_transfer_t* transfer;
+    if (curl_easy_getinfo(curl_handle, CURLINFO_PRIVATE, (char**)&transfer)
+        || transfer == NULL) {
+      syslog(LOG_ERR, "finish_completed:curl_easy_getinfo(CURLINFO_PRIVATE)");
+      continue;
+    }
+    curl_multi_remove_handle(engine->multi_handle, curl_handle);
+    complete_transfer(engine, transfer, result);
+  }
+
+  start_pending(engine);
+}
+
+/* Give up on unpaused transfers whose deadlines have passed. */
+static void expire_transfers(upload_engine_t* engine, int64_t current_time) {
+  int expired = 0;
+  int idx;
+  for (idx = 0; idx < engine->max_transfers; ++idx) {
+    upload_transfer_t* transfer = &engine->transfers[idx];
+    if (transfer->request == NULL
+        || transfer->paused
+        || transfer->deadline < 0
+        || transfer->deadline > current_time) {
+      continue;
+    }
+    curl_multi_remove_handle(engine->multi_handle, transfer->curl_handle);
+    complete_transfer(engine, transfer, CURLE_OPERATION_TIMEDOUT);
+    expired = 1;
+  }
+  if (expired) {
+    start_pending(engine);
+  }
+}
+
+static int socket_action(upload_engine_t* engine, curl_socket_t socket, int mask) {
+  int running_handles;
+  CURLMcode rc = curl_multi_socket_action(
+      engine->multi_handle, socket, mask, &running_handles);
+  if (rc != CURLM_OK) {
+    syslog(LOG_ERR,
+           "socket_action:curl_multi_socket_action: %s",
+           curl_multi_strerror(rc));
+    return -1;
+  }
+  finish_completed(engine);
+  return 0;
+}
+
+int upload_engine_socket_event(upload_engine_t* engine,
+                               int fd,
+                               uint32_t events) {
+  int mask = ((events & EPOLLIN) ? CURL_CSELECT_IN : 0)
+      | ((events & EPOLLOUT) ? CURL_CSELECT_OUT : 0)
+      | ((events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+  return socket_action(engine, fd, mask);
+}
+
+int upload_engine_set_rate_limit(upload_engine_t* engine,
+                                 int index,
+                                 size_t rate,
+                                 size_t burst) {
+  int64_t current_time = monotonic_milliseconds();
+  if (index < 0) {
+    token_bucket_configure(&engine->limit, rate, burst, current_time);
+  } else {
+    if (index >= engine->num_directory_limits) {
+      if (rate == 0) {
+        return 0;
+      }
+      token_bucket_t* limits = realloc(engine->directory_limits,
+                                       (index + 1) * sizeof(limits[0]));
+      if (limits == NULL) {
+        syslog(LOG_ERR,
+               "upload_engine_set_rate_limit:realloc: %s",
+               strerror(errno));
+        return -1;
+      }
+      for (; engine->num_directory_limits <= index;
+           ++engine->num_directory_limits) {
+        token_bucket_init(&limits[engine->num_directory_limits]);
+      }
+      engine->directory_limits = limits;
+    }
+    token_bucket_configure(
+        &engine->directory_limits[index], rate, burst, current_time);
+  }
+  /* Let paused transfers find out whether the new limits allow more. */
+  if (engine->resume_deadline >= 0) {
+    engine->resume_deadline = current_time;
+  }
+  return 0;
+}
+
+int upload_engine_set_directory_fd(upload_engine_t* engine, int index, int fd) {
+  if (index < 0) {
+    return -1;
+  }
+  if (index >= engine->num_directory_fds) {
+    if (fd < 0) {
+      return 0;
+    }
+    int* fds = realloc(engine->directory_fds, (index + 1) * sizeof(fds[0]));
+    if (fds == NULL) {
+      syslog(LOG_ERR,
+             "upload_engine_set_directory_fd:realloc: %s",
+             strerror(errno));
+      return -1;
+    }
+    for (; engine->num_directory_fds <= index; ++engine->num_directory_fds) {
+      fds[engine->num_directory_fds] = -1;
+    }
+    engine->directory_fds = fds;
+  }
+  engine->directory_fds[index] = fd;
+  /* Transfers in flight may still have archive members to open. */
+  int idx;
+  for (idx = 0; idx < engine->max_transfers; ++idx) {
+    upload_transfer_t* transfer = &engine->transfers[idx];
+    if (transfer->request != NULL && transfer->request->index == index) {
+      transfer->body.directory_fd = fd;
+    }
+  }
+  return 0;
+}
+
+/* Return the earlier of two deadlines, where -1 means no deadline. */
+static int64_t earlier_deadline(int64_t first, int64_t second) {
+  if (first < 0 || (second >= 0 && second < first)) {
+    return second;
+  }
+  return first;
+}
+
+int64_t upload_engine_deadline(const upload_engine_t* engine) {
+  int64_t deadline = earlier_deadline(engine->deadline,
+                                      engine->resume_deadline);
+  int idx;
+  for (idx = 0; idx < engine->max_transfers; ++idx) {
+    const upload_transfer_t* transfer = &engine->transfers[idx];
+    if (transfer->request != NULL && !transfer->paused) {
+      deadline = earlier_deadline(deadline, transfer->deadline);
+    }
+  }
+  return deadline;
+}
+
+/* Unpause every paused transfer, highest priority first. cURL calls their
+ * read callbacks again, which pause the ones the limits still hold back,
+ * perhaps before curl_easy_pause() returns; so each priority level is only
+ * visited once. */
+static void resume_paused(upload_engine_t* engine) {
+  int64_t current_time = monotonic_milliseconds();
+  int below_priority = 0;
+  int bounded = 0;
+  while (1) {
+    int priority = 0;
+    int found = 0;
+    int idx;
+    for (idx = 0; idx < engine->max_transfers; ++idx) {
+      const upload_transfer_t* transfer = &engine->transfers[idx];
+      if (transfer->paused
+          && (!bounded || transfer->request->priority < below_priority)
+          && (!found || transfer->request->priority > priority)) {
+        priority = transfer->request->priority;
+        found = 1;
+      }
+    }
+    if (!found) {
+      break;
+    }
+    for (idx = 0; idx < engine->max_transfers; ++idx) {
+      upload_transfer_t* transfer = &engine->transfers[idx];
+      if (!transfer->paused || transfer->request->priority != priority) {
+        continue;
+      }
+      transfer->paused = 0;
+      if (transfer->deadline >= 0) {
+        transfer->deadline += current_time - transfer->paused_at;
+      }
+      CURLcode rc = curl_easy_pause(transfer->curl_handle, CURLPAUSE_CONT);
+      if (rc != CURLE_OK) {
+        syslog(LOG_ERR,
+               "resume_paused:curl_easy_pause: %s",
+               curl_easy_strerror(rc));
+      }
+    }
+    below_priority = priority;
+    bounded = 1;
+  }
+}
+
+int upload_engine_perform(upload_engine_t* engine) {
+  if (engine->resume_deadline >= 0
+      && engine->resume_deadline <= monotonic_milliseconds()) {
+    engine->resume_deadline = -1;
+    resume_paused(engine);
+  }
+  expire_transfers(engine, monotonic_milliseconds());
+  if (engine->deadline >= 0 && engine->deadline <= monotonic_milliseconds()) {
+    engine->deadline = -1;
+    return socket_action(engine, CURL_SOCKET_TIMEOUT, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+#ifndef _BISMARK_DATA_TRANSMIT_UPLOAD_ENGINE_H_
+#define _BISMARK_DATA_TRANSMIT_UPLOAD_ENGINE_H_
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <curl/curl.h>
+
+#include "link_estimate.h"
+#include "token_bucket.h"
+#include "upload_body.h"
+
+/* One PUT to the server. A plain request uploads its single member under
+ * the member's own name; an archive request bundles all of its members into
+ * one tar body named filename. */
+typedef struct upload_request {
+  char filename[PATH_MAX + 1];
+  const char* directory;
+  int index;
+  int archive;
+  upload_encoding_t encoding;
+  /* Waiting requests start in descending priority order. */
+  int priority;
+  upload_member_t* members;
+  int num_members;
+  int members_capacity;
+  /* How the transfer ended, filled in before the done callback runs.
+   * result is CURLE_FAILED_INIT if the transfer never started. */
+  CURLcode result;
+  long response_code;
+  /* How long setting up a new connection took, including the TLS handshake,
+   * or -1 if the transfer reused one; how long the whole transfer took, in
+   * seconds; and how many body bytes went out. */
+  double connect_time;
+  double total_time;
+  curl_off_t bytes_sent;
+  /* The TCP handshake time of a new connection, or -1; and the average
+   * upload speed in bytes per second. */
+  double round_trip_time;
+  double upload_speed;
+  /* Set if the rate limits held the transfer back, so that its speed and
+   * any timeout say nothing about the server or the link. */
+  int throttled;
+  struct upload_request* next;
+} upload_request_t;
+
+/* Called once for every submitted upload when its transfer finishes.
+ * succeeded is 1 if the server accepted the upload and 0 otherwise. */
+typedef void (*upload_done_callback_t)(const upload_request_t* request,
+                                       int succeeded);
+
+struct upload_engine;
+
+typedef struct {
+  struct upload_engine* engine;
+  CURL* curl_handle;
+  upload_body_t body;
+  struct curl_slist* headers;
+  upload_request_t* request;
+  /* Set while the transfer waits for a rate limit to allow more bytes, since
+   * paused_at. */
+  int paused;
+  int64_t paused_at;
+  /* When the transfer is given up, in milliseconds on the monotonic clock.
+   * Time spent paused pushes it back. */
+  int64_t deadline;
+  char error_message[CURL_ERROR_SIZE];
+} upload_transfer_t;
+
+typedef struct upload_engine {
+  CURLM* multi_handle;
+  /* cURL's sockets are registered here, tagged with their fds. */
+  int epoll_fd;
+  /* When cURL next needs a timeout action on the monotonic clock, in
+   * milliseconds, or -1. */
+  int64_t deadline;
+  /* When paused transfers may be able to send again, or -1. */
+  int64_t resume_deadline;
+  const char* uploads_url;
+  const char* bismark_id;
+  upload_done_callback_t done_callback;
+
+  /* One slot per concurrent transfer. A slot is idle when its request is
+   * NULL. The easy handles are reused so connections stay cached. */
+  upload_transfer_t* transfers;
+  int max_transfers;
+  int num_active;
+
+  /* Uploads waiting for a free transfer slot, by descending priority and
+   * then in submission order. */
+  upload_request_t* pending_head;
+  upload_request_t* pending_tail;
+  int num_pending;
+
+  /* Rate limits on the bytes sent by all transfers together, and by the
+   * transfers of each directory, indexed by request index. Transfers that
+   * run out of tokens are paused. While a paused transfer only waits for
+   * the shared limit, lower priority transfers don't take its tokens. */
+  token_bucket_t limit;
+  token_bucket_t* directory_limits;
+  int num_directory_limits;
+
+  /* Open fds of the upload directories, indexed by request index, or -1.
+   * Members are opened relative to them rather than by absolute path. */
+  int* directory_fds;
+  int num_directory_fds;
+
+  /* Measured from finished transfers. Limits how many of the transfer slots
+   * are in use and sets each transfer's timeouts. */
+  link_estimate_t link;
+} upload_engine_t;
+
+int upload_engine_init(upload_engine_t* engine,
+                       const char* uploads_url,
+                       const char* bismark_id,
+                       int max_transfers,
+                       upload_done_callback_t done_callback,
+                       int epoll_fd);
+void upload_engine_destroy(upload_engine_t* engine);
+
+/* Allocate a request. Plain requests get filename as their only member;
+ * archive requests start empty. directory must outlive the request. */
+upload_request_t* upload_request_new(const char* filename,
+                                     const char* directory,
+                                     int index,
+                                     int archive);
+int upload_request_add_member(upload_request_t* request, const char* filename);
+void upload_request_free(upload_request_t* request);
+
+/* Return 1 if a finished request failed because the server couldn't be
+ * reached or reported a server error, as opposed to a local problem. A
+ * throttled request that timed out is put down to the rate limits. */
+int upload_request_server_failed(const upload_request_t* request);
+
+/* Queue a request, taking ownership of it even on failure. */
+int upload_engine_enqueue(upload_engine_t* engine, upload_request_t* request);
+
+/* Queue a single file for upload. The caller is responsible for not
+ * submitting a file that is already queued or in flight. */
+int upload_engine_submit(upload_engine_t* engine,
+                         const char* filename,
+                         const char* directory,
+                         int index,
+                         upload_encoding_t encoding,
+                         int priority);
+
+/* Limit the upload rate of one directory's requests, or of all requests
+ * together for index -1, to rate bytes per second with bursts of up to
+ * burst bytes. A rate of 0 lifts the limit. */
+int upload_engine_set_rate_limit(upload_engine_t* engine,
+                                 int index,
+                                 size_t rate,
+                                 size_t burst);
+
+/* Open the members of requests with this index relative to fd from now on,
+ * or by absolute path if fd is -1. The fd must stay open until it is
+ * replaced. */
+int upload_engine_set_directory_fd(upload_engine_t* engine, int index, int fd);
+
+/* When upload_engine_perform() next has work to do without a socket event,
+ * in milliseconds on the monotonic clock, or -1. */
+int64_t upload_engine_deadline(const upload_engine_t* engine);
+
+/* Handle epoll events on one of cURL's sockets. */
+int upload_engine_socket_event(upload_engine_t* engine,
+                               int fd,
+                               uint32_t events);
+
+/* Resume paused transfers, give up on ones past their deadlines and run
+ * cURL's timeout action if its deadline has passed, invoke the done callback for finished uploads and start
+ * pending ones. */
+int upload_engine_perform(upload_engine_t* engine);
+
+#endif
@@ -0,0 +1,266 @@
+#include "upload_journal.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#ifndef JOURNAL_FLUSH_SECONDS
+#define JOURNAL_FLUSH_SECONDS  5
+#endif
+#define JOURNAL_BUFFER_SIZE  16384
+#define MAX_RECORD_LENGTH  (PATH_MAX + 64)
+
+void upload_journal_init(upload_journal_t* journal, const char* filename) {
+  strncpy(journal->filename, filename, PATH_MAX);
+  journal->filename[PATH_MAX] = '\0';
+  journal->handle = NULL;
+  journal->snapshotting = 0;
+  journal->num_records = 0;
+  journal->flush_deadline = -1;
+  journal->lost_records = 0;
+}
+
+/* Fill in the name of the file snapshots are written to before they
+ * replace the journal. */
+static int snapshot_filename(const char* filename, char* result) {
+  if (snprintf(result, PATH_MAX + 1, "%s.tmp", filename) > PATH_MAX) {
+    syslog(LOG_ERR, "snapshot_filename: \"%s\" is too long", filename);
+    return -1;
+  }
+  return 0;
+}
+
+static int open_handle(upload_journal_t* journal,
+                       const char* filename,
+                       const char* mode) {
+  journal->handle = fopen(filename, mode);
+  if (journal->handle == NULL) {
+    syslog(LOG_ERR,
+           "upload_journal:fopen(\"%s\"): %s",
+           filename,
+           strerror(errno));
+    return -1;
+  }
+  /* Hold records back until the flush deadline rather than writing every
+   * line as it comes. */
+  (void)setvbuf(journal->handle, NULL, _IOFBF, JOURNAL_BUFFER_SIZE);
+  return 0;
+}
+
+/* Undo the escaping done by write_name(), in place. */
+static int unescape_name(char* name) {
+  char* output = name;
+  for (; *name != '\0'; ++name) {
+    if (*name == '\\') {
+      ++name;
+      if (*name == 'n') {
+        *output++ = '\n';
+      } else if (*name == '\\') {
+        *output++ = '\\';
+      } else {
+        return -1;
+      }
+    } else {
+      *output++ = *name;
+    }
+  }
+  *output = '\0';
+  return 0;
+}
+
+static int write_name(FILE* handle, const char* name) {
+  for (; *name != '\0'; ++name) {
+    int result;
+    if (*name == '\n') {
+      result = fputs("\\n", handle);
+    } else if (*name == '\\') {
+      result = fputs("\\\\", handle);
+    } else {
+      result = putc(*name, handle);
+    }
+    if (result == EOF) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int parse_record(char* line, upload_journal_record_t* record) {
+  size_t length = strlen(line);
+  if (length == 0 || line[length - 1] != '\n') {
+    return -1;  /* Cut short. */
+  }
+  line[length - 1] = '\0';
+  char type;
+  int name_offset = -1;
+  if (sscanf(line,
+             "%c %" SCNd64 " %" SCNd64 " %n",
+             &type,
+             &record->time,
+             &record->value,
+             &name_offset) < 3
+      || name_offset < 0
+      || line[name_offset] == '\0'
+      || unescape_name(line + name_offset)) {
+    return -1;
+  }
+  switch (type) {
+    case UPLOAD_JOURNAL_ADD:
+    case UPLOAD_JOURNAL_FAIL:
+    case UPLOAD_JOURNAL_REMOVE:
+    case UPLOAD_JOURNAL_EVICT:
+    case UPLOAD_JOURNAL_COUNT:
+    case UPLOAD_JOURNAL_MTIME:
+      record->type = type;
+      break;
+    default:
+      return -1;
+  }
+  record->name = line + name_offset;
+  return 0;
+}
+
+int upload_journal_replay(const char* filename,
+                          upload_journal_callback_t callback,
+                          void* userdata) {
+  FILE* handle = fopen(filename, "r");
+  if (handle == NULL) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    syslog(LOG_ERR,
+           "upload_journal_replay:fopen(\"%s\"): %s",
+           filename,
+           strerror(errno));
+    return -1;
+  }
+  char line[MAX_RECORD_LENGTH];
+  int skipped = 0;
+  while (fgets(line, sizeof(line), handle)) {
+    upload_journal_record_t record;
+    if (parse_record(line, &record)) {
+      ++skipped;
+    } else {
+      callback(&record, userdata);
+    }
+  }
+  fclose(handle);
+  if (skipped > 0) {
+    syslog(LOG_WARNING,
+           "upload_journal_replay: skipped %d malformed records in %s",
+           skipped,
+           filename);
+  }
+  return 0;
+}
+
+int upload_journal_begin(upload_journal_t* journal) {
+  if (journal->handle != NULL) {
+    fclose(journal->handle);
+    journal->handle = NULL;
+  }
+  char temporary[PATH_MAX + 1];
+  if (snapshot_filename(journal->filename, temporary)
+      || open_handle(journal, temporary, "w")) {
+    return -1;
+  }
+  journal->snapshotting = 1;
+  journal->num_records = 0;
+  journal->flush_deadline = -1;
+  journal->lost_records = 0;
+  return 0;
+}
+
+int upload_journal_commit(upload_journal_t* journal) {
+  if (!journal->snapshotting || journal->handle == NULL) {
+    return -1;
+  }
+  journal->snapshotting = 0;
+  journal->num_records = 0;
+  journal->flush_deadline = -1;
+  char temporary[PATH_MAX + 1];
+  int failed = fflush(journal->handle) != 0;
+  if (failed) {
+    syslog(LOG_ERR, "upload_journal_commit:fflush: %s", strerror(errno));
+  }
+  fclose(journal->handle);
+  journal->handle = NULL;
+  if (!failed && !snapshot_filename(journal->filename, temporary)
+      && rename(temporary, journal->filename)) {
+    syslog(LOG_ERR,
+           "upload_journal_commit:rename(\"%s\"): %s",
+           temporary,
+           strerror(errno));
+    failed = 1;
+  }
+  /* On failure keep appending to the old journal, which now misses the
+   * state captured by the snapshot. */
+  if (failed) {
+    journal->lost_records = 1;
+  }
+  if (open_handle(journal, journal->filename, "a")) {
+    journal->lost_records = 1;
+    return -1;
+  }
+  return failed ? -1 : 0;
+}
+
+int upload_journal_append(upload_journal_t* journal,
+                          const upload_journal_record_t* record,
+                          time_t current_time) {
+  if (journal->handle == NULL) {
+    journal->lost_records = 1;
+    return -1;
+  }
+  if (fprintf(journal->handle,
+              "%c %" PRId64 " %" PRId64 " ",
+              (char)record->type,
+              record->time,
+              record->value) < 0
+      || write_name(journal->handle, record->name)
+      || putc('\n', journal->handle) == EOF) {
+    syslog(LOG_ERR, "upload_journal_append:fprintf: %s", strerror(errno));
+    journal->lost_records = 1;
+    return -1;
+  }
+  ++journal->num_records;
+  if (journal->flush_deadline < 0 && !journal->snapshotting) {
+    journal->flush_deadline = current_time + JOURNAL_FLUSH_SECONDS;
+  }
+  return 0;
+}
+
+int upload_journal_flush(upload_journal_t* journal,
+                         time_t current_time,
+                         int force) {
+  if (journal->handle == NULL
+      || journal->flush_deadline < 0
+      || (!force && journal->flush_deadline > current_time)) {
+    return 0;
+  }
+  journal->flush_deadline = -1;
+  if (fflush(journal->handle)) {
+    syslog(LOG_ERR, "upload_journal_flush:fflush: %s", strerror(errno));
+    journal->lost_records = 1;
+    return -1;
+  }
+  return 0;
+}
+
+void upload_journal_close(upload_journal_t* journal) {
+  if (journal->handle == NULL) {
+    return;
+  }
+  if (journal->snapshotting) {
+    /* Leave the old journal in place rather than a partial snapshot. */
+    fclose(journal->handle);
+    journal->snapshotting = 0;
+  } else {
+    (void)upload_journal_flush(journal, 0, 1);
+    fclose(journal->handle);
+  }
+  journal->handle = NULL;
+  journal->flush_deadline = -1;
+}
@@ -0,0 +1,88 @@
+#ifndef _BISMARK_DATA_TRANSMIT_UPLOAD_JOURNAL_H_
+#define _BISMARK_DATA_TRANSMIT_UPLOAD_JOURNAL_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef enum {
+  UPLOAD_JOURNAL_ADD = 'A',     /* A file was indexed or changed. */
+  UPLOAD_JOURNAL_FAIL = 'F',    /* An upload attempt failed. */
+  UPLOAD_JOURNAL_REMOVE = 'R',  /* The file was uploaded or went away. */
+  UPLOAD_JOURNAL_EVICT = 'E',   /* The file was deleted to respect a quota. */
+  UPLOAD_JOURNAL_COUNT = 'C',   /* A directory's failure counter. */
+  UPLOAD_JOURNAL_MTIME = 'M'    /* A directory's mtime at a clean shutdown. */
+} upload_journal_type_t;
+
+typedef struct {
+  upload_journal_type_t type;
+  /* ADD: modification time. FAIL: wall clock time of the next attempt.
+   * MTIME: seconds of the directory's modification time. */
+  int64_t time;
+  /* ADD: size in bytes. FAIL: attempts so far. COUNT: failure count.
+   * MTIME: nanoseconds of the directory's modification time. */
+  int64_t value;
+  /* Absolute filename, or the directory name for COUNT and MTIME. Newlines
+   * and backslashes are escaped in the file. */
+  const char* name;
+} upload_journal_record_t;
+
+/* An append-only log of what happened to pending uploads, so a restarted
+ * daemon remembers attempt counts and failure counters and, after a clean
+ * shutdown, needn't walk directories that haven't changed since.
+ *
+ * Records are one line of text each: "<type> <time> <value> <name>".
+ * Appends are buffered and written out at most every JOURNAL_FLUSH_SECONDS
+ * to spare flash; a crash loses at most that much history, which the
+ * startup scan makes up for. The journal is rewritten from a snapshot of
+ * the daemon's state whenever it has grown too long. */
+typedef struct {
+  char filename[PATH_MAX + 1];
+  /* Appends go here; NULL if the journal couldn't be opened. */
+  FILE* handle;
+  /* Set while a snapshot is being written to filename.tmp. */
+  int snapshotting;
+  /* Records appended since the last snapshot. */
+  int num_records;
+  /* When buffered records must be written out on the monotonic clock, or -1
+   * if nothing is buffered. */
+  time_t flush_deadline;
+  /* Set once a record failed to reach the file. The journal is then
+   * incomplete until the next snapshot. */
+  int lost_records;
+} upload_journal_t;
+
+typedef void (*upload_journal_callback_t)(const upload_journal_record_t* record,
+                                          void* userdata);
+
+void upload_journal_init(upload_journal_t* journal, const char* filename);
+
+/* Call callback for every record in the journal file, oldest first.
+ * Malformed lines, such as a line cut short by a crash, are skipped. A
+ * missing file is not an error. */
+int upload_journal_replay(const char* filename,
+                          upload_journal_callback_t callback,
+                          void* userdata);
+
+/* Start a snapshot of the daemon's state. Records appended until
+ * upload_journal_commit() replace the journal's contents. The journal
+ * needn't be open yet. */
+int upload_journal_begin(upload_journal_t* journal);
+/* Atomically replace the journal with the snapshot and keep appending to
+ * it. */
+int upload_journal_commit(upload_journal_t* journal);
+
+int upload_journal_append(upload_journal_t* journal,
+                          const upload_journal_record_t* record,
+                          time_t current_time);
+
+/* Write out buffered records if their flush deadline has come, or if force
+ * is set. */
+int upload_journal_flush(upload_journal_t* journal,
+                         time_t current_time,
+                         int force);
+
+void upload_journal_close(upload_journal_t* journal);
+
+#endif
@@ -5,19 +5,243 @@
 #include <string.h>
 #include <syslog.h>
 
+static unsigned int hash_filename(const char* filename) {
+  unsigned int hash = 5381;
+  while (*filename) {
+    hash = hash * 33 + (unsigned char)*filename++;
+  }
+  return hash;
+}
+
+/* Rebuild the hash chains from scratch with num_buckets buckets. */
+static int rehash(upload_list_t* list, int num_buckets) {
+  int* buckets = malloc(num_buckets * sizeof(buckets[0]));
+  if (buckets == NULL) {
+    syslog(LOG_ERR, "upload_list:rehash:malloc: %s", strerror(errno));
+    return -1;
+  }
+  free(list->buckets);
+  list->buckets = buckets;
+  list->num_buckets = num_buckets;
+  int idx;
+  for (idx = 0; idx < num_buckets; ++idx) {
+    buckets[idx] = -1;
+  }
+  for (idx = 0; idx < list->length; ++idx) {
+    upload_entry_t* entry = &list->entries[idx];
+    int bucket = hash_filename(upload_list_filename(list, entry)) % num_buckets;
+    entry->next = buckets[bucket];
+    buckets[bucket] = idx;
+  }
+  return 0;
+}
+
+/* Copy filename onto the end of the name arena and return its offset in
+ * *name. */
+static int store_name(upload_list_t* list, const char* filename, size_t* name) {
+  size_t length = strlen(filename) + 1;
+  if (list->names_length + length > list->names_capacity) {
+    size_t capacity = list->names_capacity ? list->names_capacity : 1024;
+    while (list->names_length + length > capacity) {
+      capacity *= 2;
+    }
+    char* names = realloc(list->names, capacity);
+    if (names == NULL) {
+      syslog(LOG_ERR, "upload_list:store_name:realloc: %s", strerror(errno));
+      return -1;
+    }
+    list->names = names;
+    list->names_capacity = capacity;
+  }
+  memcpy(list->names + list->names_length, filename, length);
+  *name = list->names_length;
+  list->names_length += length;
+  return 0;
+}
+
+/* Squeeze removed names out of the arena once they take up half of it. */
+static void compact_names(upload_list_t* list) {
+  if (list->names_garbage < 4096
+      || list->names_garbage < list->names_length / 2) {
+    return;
+  }
+  char* names = malloc(list->names_capacity);
+  if (names == NULL) {
+    /* Not fatal; the garbage just stays around a while longer. */
+    return;
+  }
+  size_t names_length = 0;
+  int idx;
+  for (idx = 0; idx < list->length; ++idx) {
+    upload_entry_t* entry = &list->entries[idx];
+    size_t length = strlen(list->names + entry->name) + 1;
+    memcpy(names + names_length, list->names + entry->name, length);
+    entry->name = names_length;
+    names_length += length;
+  }
+  free(list->names);
+  list->names = names;
+  list->names_length = names_length;
+  list->names_garbage = 0;
+}
+
+/* Grow the per-index state to cover index. */
+static int reserve_index(upload_list_t* list, int index) {
+  if (index < list->num_indices) {
+    return 0;
+  }
+  int num_indices = index + 1;
+  upload_index_t* indices = realloc(list->indices,
+                                    num_indices * sizeof(indices[0]));
+  if (indices == NULL) {
+    syslog(LOG_ERR, "upload_list:reserve_index:realloc: %s", strerror(errno));
+    return -1;
+  }
+  memset(indices + list->num_indices,
+         0,
+         (num_indices - list->num_indices) * sizeof(indices[0]));
+  list->indices = indices;
+  list->num_indices = num_indices;
+  return 0;
+}
+
+/* Add delta bytes to the totals for index, which must already exist. */
+static void account(upload_list_t* list, int index, size_t delta) {
+  list->indices[index].total_size += delta;
+  list->total_size += delta;
+}
+
+static int* heap_position(const upload_list_t* list,
+                          const upload_heap_t* heap,
+                          upload_entry_t* entry) {
+  return heap == &list->schedule ? &entry->heap_position
+                                 : &entry->eviction_position;
+}
+
+static int heap_before(const upload_list_t* list,
+                       const upload_heap_t* heap,
+                       int first,
+                       int second) {
+  const upload_entry_t* first_entry = &list->entries[heap->slots[first]];
+  const upload_entry_t* second_entry = &list->entries[heap->slots[second]];
+  if (heap != &list->schedule) {
+    return first_entry->last_modified < second_entry->last_modified;
+  }
+  if (first_entry->next_attempt != second_entry->next_attempt) {
+    return first_entry->next_attempt < second_entry->next_attempt;
+  }
+  return first_entry->priority > second_entry->priority;
+}
+
+static void heap_swap(upload_list_t* list,
+                      upload_heap_t* heap,
+                      int first,
+                      int second) {
+  int position = heap->slots[first];
+  heap->slots[first] = heap->slots[second];
+  heap->slots[second] = position;
+  *heap_position(list, heap, &list->entries[heap->slots[first]]) = first;
+  *heap_position(list, heap, &list->entries[heap->slots[second]]) = second;
+}
+
+/* Restore the heap property around heap slot, which just changed. */
+static void heap_fix(upload_list_t* list, upload_heap_t* heap, int slot) {
+  while (slot > 0 && heap_before(list, heap, slot, (slot - 1) / 2)) {
+    heap_swap(list, heap, slot, (slot - 1) / 2);
+    slot = (slot - 1) / 2;
+  }
+  while (1) {
+    int smallest = slot;
+    int child;
+    for (child = 2 * slot + 1;
+         child <= 2 * slot + 2 && child < heap->length;
+         ++child) {
+      if (heap_before(list, heap, child, smallest)) {
+        smallest = child;
+      }
+    }
+    if (smallest == slot) {
+      break;
+    }
+    heap_swap(list, heap, slot, smallest);
+    slot = smallest;
+  }
+}
+
+static int heap_push(upload_list_t* list,
+                     upload_heap_t* heap,
+                     upload_entry_t* entry) {
+  if (heap->length >= heap->capacity) {
+    int capacity = heap->capacity ? heap->capacity * 2 : 16;
+    int* slots = realloc(heap->slots, capacity * sizeof(slots[0]));
+    if (slots == NULL) {
+      syslog(LOG_ERR, "upload_list:heap_push:realloc: %s", strerror(errno));
+      return -1;
+    }
+    heap->slots = slots;
+    heap->capacity = capacity;
+  }
+  int slot = heap->length++;
+  heap->slots[slot] = entry - list->entries;
+  *heap_position(list, heap, entry) = slot;
+  heap_fix(list, heap, slot);
+  return 0;
+}
+
+static void heap_delete(upload_list_t* list,
+                        upload_heap_t* heap,
+                        upload_entry_t* entry) {
+  int* position = heap_position(list, heap, entry);
+  int slot = *position;
+  if (slot < 0) {
+    return;
+  }
+  *position = -1;
+  int last = --heap->length;
+  if (slot != last) {
+    heap->slots[slot] = heap->slots[last];
+    *heap_position(list, heap, &list->entries[heap->slots[slot]]) = slot;
+    heap_fix(list, heap, slot);
+  }
+}
+
 int upload_list_init(upload_list_t* list) {
   list->capacity = 16;
   list->length = 0;
+  list->total_size = 0;
+  list->indices = NULL;
+  list->num_indices = 0;
+  list->names = NULL;
+  list->names_length = 0;
+  list->names_capacity = 0;
+  list->names_garbage = 0;
+  list->buckets = NULL;
+  list->schedule.slots = NULL;
+  list->schedule.length = 0;
+  list->schedule.capacity = 0;
   list->entries = malloc(list->capacity * sizeof(list->entries[0]));
   if (list->entries == NULL) {
     syslog(LOG_ERR, "uploads_list_init:malloc: %s", strerror(errno));
     return -1;
   }
+  if (rehash(list, list->capacity)) {
+    free(list->entries);
+    list->entries = NULL;
+    return -1;
+  }
   return 0;
 }
 
 void upload_list_destroy(upload_list_t* list) {
+  int idx;
+  for (idx = 0; idx < list->num_indices; ++idx) {
+    free(list->indices[idx].evictions.slots);
+  }
+  free(list->indices);
   free(list->entries);
+  free(list->buckets);
+  free(list->schedule.slots);
+  free(list->names);
 }
 
 int upload_list_append(upload_list_t* list,
@@ -25,42 +249,208 @@ int upload_list_append(upload_list_t* list,
                        const time_t last_modified,
                        const size_t size,
                        const int index) {
-  if (list->entries == NULL) {
+  if (list->entries == NULL || index < 0 || reserve_index(list, index)) {
     return -1;
   }
   if (list->length >= list->capacity) {
-    list->capacity *= 2;
+    int capacity = list->capacity * 2;
     void* new_entries = realloc(list->entries,
-                                list->capacity * sizeof(list->entries[0]));
+                                capacity * sizeof(list->entries[0]));
     if (new_entries == NULL) {
       syslog(LOG_ERR, "uploads_list_append:realloc: %s", strerror(errno));
       return -1;
-    } else {
-      list->entries = new_entries;
     }
+    list->entries = new_entries;
+    list->capacity = capacity;
+  }
+  size_t name;
+  if (store_name(list, filename, &name)) {
+    return -1;
   }
 
-  ++list->length;
-  upload_entry_t* entry = &list->entries[list->length - 1];
-  strncpy(entry->filename, filename, PATH_MAX);
+  upload_entry_t* entry = &list->entries[list->length];
+  entry->name = name;
   entry->last_modified = last_modified;
   entry->size = size;
   entry->index = index;
+  entry->priority = 0;
+  entry->pending = 0;
+  entry->attempts = 0;
+  entry->debounce_deadline = -1;
+  entry->next_attempt = 0;
+  entry->heap_position = -1;
+  entry->eviction_position = -1;
+  if (heap_push(list, &list->indices[index].evictions, entry)) {
+    list->names_length = name;
+    return -1;
+  }
+  ++list->length;
+  account(list, index, size);
+
+  if (list->length > list->num_buckets) {
+    return rehash(list, list->capacity);
+  }
+  int bucket = hash_filename(filename) % list->num_buckets;
+  entry->next = list->buckets[bucket];
+  list->buckets[bucket] = list->length - 1;
   return 0;
 }
 
-static int compare_uploads(const void* first, const void* second) {
-  const upload_entry_t* first_entry = first;
-  const upload_entry_t* second_entry = second;
-  if (first_entry->last_modified < second_entry->last_modified) {
-    return 1;
-  } else if (first_entry->last_modified > second_entry->last_modified) {
-    return -1;
-  } else {
+const char* upload_list_filename(const upload_list_t* list,
+                                 const upload_entry_t* entry) {
+  return list->names + entry->name;
+}
+
+size_t upload_list_index_size(const upload_list_t* list, int index) {
+  if (index < 0 || index >= list->num_indices) {
     return 0;
   }
+  return list->indices[index].total_size;
 }
 
-void upload_list_sort(upload_list_t* list) {
-  qsort(list->entries, list->length, sizeof(list->entries[0]), compare_uploads);
+upload_entry_t* upload_list_find(upload_list_t* list, const char* filename) {
+  if (list->buckets == NULL) {
+    return NULL;
+  }
+  int position = list->buckets[hash_filename(filename) % list->num_buckets];
+  while (position >= 0) {
+    upload_entry_t* entry = &list->entries[position];
+    if (!strcmp(upload_list_filename(list, entry), filename)) {
+      return entry;
+    }
+    position = entry->next;
+  }
+  return NULL;
+}
+
+upload_entry_t* upload_list_update(upload_list_t* list,
+                                   const char* filename,
+                                   const time_t last_modified,
+                                   const size_t size,
+                                   const int index) {
+  upload_entry_t* entry = upload_list_find(list, filename);
+  if (entry == NULL) {
+    if (upload_list_append(list, filename, last_modified, size, index)) {
+      return NULL;
+    }
+    return &list->entries[list->length - 1];
+  }
+  if (index != entry->index) {
+    if (index < 0 || reserve_index(list, index)) {
+      return NULL;
+    }
+    if (entry->eviction_position >= 0) {
+      heap_delete(list, &list->indices[entry->index].evictions, entry);
+      /* On failure the entry just can't be evicted. */
+      (void)heap_push(list, &list->indices[index].evictions, entry);
+    }
+  }
+  account(list, entry->index, -entry->size);
+  account(list, index, size);
+  entry->last_modified = last_modified;
+  entry->size = size;
+  entry->index = index;
+  if (entry->eviction_position >= 0) {
+    heap_fix(list, &list->indices[index].evictions, entry->eviction_position);
+  }
+  return entry;
+}
+
+/* Point whatever references position in its hash chain at replacement. */
+static void relink(upload_list_t* list, int position, int replacement) {
+  const upload_entry_t* entry = &list->entries[position];
+  const char* filename = upload_list_filename(list, entry);
+  int* link = &list->buckets[hash_filename(filename) % list->num_buckets];
+  while (*link != position) {
+    link = &list->entries[*link].next;
+  }
+  *link = replacement;
+}
+
+int upload_list_schedule(upload_list_t* list,
+                         upload_entry_t* entry,
+                         time_t next_attempt) {
+  entry->next_attempt = next_attempt;
+  if (entry->heap_position < 0) {
+    return heap_push(list, &list->schedule, entry);
+  }
+  heap_fix(list, &list->schedule, entry->heap_position);
+  return 0;
+}
+
+void upload_list_unschedule(upload_list_t* list, upload_entry_t* entry) {
+  heap_delete(list, &list->schedule, entry);
+}
+
+upload_entry_t* upload_list_next_scheduled(upload_list_t* list) {
+  if (list->schedule.length == 0) {
+    return NULL;
+  }
+  return &list->entries[list->schedule.slots[0]];
+}
+
+int upload_list_set_pending(upload_list_t* list,
+                            upload_entry_t* entry,
+                            int pending) {
+  entry->pending = pending;
+  upload_heap_t* evictions = &list->indices[entry->index].evictions;
+  if (pending) {
+    heap_delete(list, evictions, entry);
+  } else if (entry->eviction_position < 0) {
+    return heap_push(list, evictions, entry);
+  }
+  return 0;
+}
+
+upload_entry_t* upload_list_next_eviction(upload_list_t* list, int index) {
+  if (index >= list->num_indices) {
+    return NULL;
+  }
+  upload_entry_t* victim = NULL;
+  int idx;
+  for (idx = index < 0 ? 0 : index;
+       idx < (index < 0 ? list->num_indices : index + 1);
+       ++idx) {
+    const upload_heap_t* evictions = &list->indices[idx].evictions;
+    if (evictions->length == 0) {
+      continue;
+    }
+    upload_entry_t* oldest = &list->entries[evictions->slots[0]];
+    if (victim == NULL
+        || oldest->priority < victim->priority
+        || (oldest->priority == victim->priority
+            && oldest->last_modified < victim->last_modified)) {
+      victim = oldest;
+    }
+  }
+  return victim;
+}
+
+void upload_list_remove(upload_list_t* list, upload_entry_t* entry) {
+  int position = entry - list->entries;
+  int last = list->length - 1;
+  heap_delete(list, &list->schedule, entry);
+  heap_delete(list, &list->indices[entry->index].evictions, entry);
+  account(list, entry->index, -entry->size);
+  size_t name_length = strlen(upload_list_filename(list, entry)) + 1;
+  if (entry->name + name_length == list->names_length) {
+    list->names_length = entry->name;
+  } else {
+    list->names_garbage += name_length;
+  }
+  relink(list, position, entry->next);
+  if (position != last) {
+    relink(list, last, position);
+    list->entries[position] = list->entries[last];
+    upload_entry_t* moved = &list->entries[position];
+    if (moved->heap_position >= 0) {
+      list->schedule.slots[moved->heap_position] = position;
+    }
+    if (moved->eviction_position >= 0) {
+      list->indices[moved->index].evictions.slots[moved->eviction_position]
+          = position;
+    }
+  }
+  --list->length;
+  compact_names(list);
 }
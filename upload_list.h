@@ -1,21 +1,79 @@
 #ifndef _BISMARK_DATA_TRANSMIT_UPLOADS_LIST_H_
 #define _BISMARK_DATA_TRANSMIT_UPLOADS_LIST_H_
 
-#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 typedef struct {
-  char filename[PATH_MAX + 1];
+  /* Offset of the filename in the list's name arena. Use
+   * upload_list_filename() to get at it. */
+  size_t name;
   time_t last_modified;
+  /* Size of the file in bytes. */
   size_t size;
   int index;
+  /* Higher priority entries are retried first and evicted last. */
+  int priority;
+  /* Set while the file is waiting in a batch or the upload engine. Change it
+   * with upload_list_set_pending(). */
+  int pending;
+  /* Number of failed upload attempts. */
+  int attempts;
+  /* For files uploaded as soon as they are closed: when the quiet period
+   * after the latest close ends, in monotonic milliseconds, or -1. */
+  int64_t debounce_deadline;
+  /* When to next attempt the upload, if the entry is scheduled. */
+  time_t next_attempt;
+  /* Position in the schedule heap, or -1 if not scheduled. */
+  int heap_position;
+  /* Position in its index's eviction heap, or -1 while pending. */
+  int eviction_position;
+  /* Next entry in the same hash bucket, or -1. */
+  int next;
 } upload_entry_t;
 
+/* A binary min-heap of entry positions. */
+typedef struct {
+  int* slots;
+  int length;
+  int capacity;
+} upload_heap_t;
+
+/* Running totals and eviction order for the entries sharing an index. */
+typedef struct {
+  size_t total_size;
+  /* Entries that aren't pending, oldest first. */
+  upload_heap_t evictions;
+} upload_index_t;
+
+/* A list of files, also indexed by filename and optionally scheduled on a
+ * min-heap of next attempt times. Entry and filename pointers are only valid
+ * until the next call that adds or removes entries.
+ *
+ * Filenames live back to back in a single arena rather than in the entries,
+ * so an entry costs tens of bytes instead of PATH_MAX. Removed names are
+ * reclaimed by compacting the arena once they make up half of it.
+ *
+ * Every index also keeps its entries that aren't pending on a min-heap of
+ * modification times, so finding the next file to evict never needs more
+ * than a look at the top of each index's heap. */
 typedef struct {
   int capacity;
   int length;
   upload_entry_t* entries;
+  char* names;
+  size_t names_length;
+  size_t names_capacity;
+  size_t names_garbage;
+  /* Sum of the size fields of all entries. */
+  size_t total_size;
+  upload_index_t* indices;
+  int num_indices;
+  int num_buckets;
+  int* buckets;
+  /* Scheduled entries ordered on next_attempt. */
+  upload_heap_t schedule;
 } upload_list_t;
 
 int upload_list_init(upload_list_t* list);
@@ -26,6 +84,47 @@ int upload_list_append(upload_list_t* list,
                        const time_t last_mofidied,
                        const size_t size,
                        const int index);
-void upload_list_sort(upload_list_t* list);
+
+/* Add a file, or update it if it's already in the list. Return the entry or
+ * NULL on error. */
+upload_entry_t* upload_list_update(upload_list_t* list,
+                                   const char* filename,
+                                   const time_t last_modified,
+                                   const size_t size,
+                                   const int index);
+
+/* The filename of an entry. */
+const char* upload_list_filename(const upload_list_t* list,
+                                 const upload_entry_t* entry);
+
+/* Sum of the size fields of the entries with the given index. */
+size_t upload_list_index_size(const upload_list_t* list, int index);
+
+/* Return the entry for filename, or NULL. */
+upload_entry_t* upload_list_find(upload_list_t* list, const char* filename);
+
+/* Remove an entry by moving the last entry into its place. */
+void upload_list_remove(upload_list_t* list, upload_entry_t* entry);
+
+/* Mark an entry as waiting to be uploaded, which protects it from eviction,
+ * or clear the mark. */
+int upload_list_set_pending(upload_list_t* list,
+                            upload_entry_t* entry,
+                            int pending);
+
+/* The entry that should be evicted first: the oldest entry with the given
+ * index, or with index -1, the oldest entry of the lowest priority. Pending
+ * entries are never returned. NULL if nothing can be evicted. */
+upload_entry_t* upload_list_next_eviction(upload_list_t* list, int index);
+
+/* Schedule an entry's next attempt, replacing any earlier schedule. */
+int upload_list_schedule(upload_list_t* list,
+                         upload_entry_t* entry,
+                         time_t next_attempt);
+void upload_list_unschedule(upload_list_t* list, upload_entry_t* entry);
+
+/* The scheduled entry with the earliest next attempt, or NULL. Ties go to
+ * the higher priority entry. */
+upload_entry_t* upload_list_next_scheduled(upload_list_t* list);
 
 #endif
@@ -0,0 +1,277 @@
+#include "upload_metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define METRIC_PREFIX  "bismark_data_transmit_"
+#define ARRAY_LENGTH(array)  ((int)(sizeof(array) / sizeof(array[0])))
+
+/* Bucket bounds in seconds. Uploads normally wait out at least one retry
+ * interval, so latencies run from seconds to a day. */
+static const double latency_bounds[] = {
+  1, 5, 15, 60, 180, 600, 1800, 3600, 10800, 86400
+};
+static const double connect_bounds[] = {
+  0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+static const double transfer_bounds[] = {
+  0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300
+};
+
+typedef struct {
+  const char* name;
+  const char* help;
+  size_t offset;
+} metric_field_t;
+
+static const metric_field_t counter_fields[] = {
+  { "files_enqueued_total",
+    "Files handed to the upload engine, counting every attempt.",
+    offsetof(upload_metrics_t, files_enqueued) },
+  { "files_uploaded_total",
+    "Files the server accepted.",
+    offsetof(upload_metrics_t, files_uploaded) },
+  { "files_failed_total",
+    "Failed attempts to upload a file.",
+    offsetof(upload_metrics_t, files_failed) },
+  { "files_evicted_total",
+    "Files deleted to respect a quota.",
+    offsetof(upload_metrics_t, files_evicted) },
+  { "bytes_sent_total",
+    "Request body bytes sent, after compression.",
+    offsetof(upload_metrics_t, bytes_sent) }
+};
+
+static const metric_field_t histogram_fields[] = {
+  { "upload_latency_seconds",
+    "Time from a file appearing to its upload succeeding.",
+    offsetof(upload_metrics_t, latency) },
+  { "connect_seconds",
+    "Time to set up a new connection, including the TLS handshake.",
+    offsetof(upload_metrics_t, connect_time) },
+  { "transfer_seconds",
+    "Duration of successful transfers.",
+    offsetof(upload_metrics_t, transfer_time) }
+};
+
+static void histogram_init(upload_histogram_t* histogram,
+                           const double* bounds,
+                           int num_bounds) {
+  memset(histogram, '\0', sizeof(*histogram));
+  histogram->bounds = bounds;
+  histogram->num_bounds = num_bounds;
+}
+
+void upload_metrics_init(upload_metrics_t* metrics) {
+  memset(metrics, '\0', sizeof(*metrics));
+  histogram_init(&metrics->latency,
+                 latency_bounds,
+                 ARRAY_LENGTH(latency_bounds));
+  histogram_init(&metrics->connect_time,
+                 connect_bounds,
+                 ARRAY_LENGTH(connect_bounds));
+  histogram_init(&metrics->transfer_time,
+                 transfer_bounds,
+                 ARRAY_LENGTH(transfer_bounds));
+}
+
+void upload_histogram_observe(upload_histogram_t* histogram, double value) {
+  int bucket = 0;
+  while (bucket < histogram->num_bounds && value > histogram->bounds[bucket]) {
+    ++bucket;
+  }
+  ++histogram->counts[bucket];
+  ++histogram->count;
+  histogram->sum += value;
+}
+
+static void write_header(FILE* handle,
+                         const char* name,
+                         const char* help,
+                         const char* type) {
+  fprintf(handle,
+          "# HELP " METRIC_PREFIX "%s %s\n# TYPE " METRIC_PREFIX "%s %s\n",
+          name,
+          help,
+          name,
+          type);
+}
+
+/* Write a sample name and its directory label. Label values must have their
+ * backslashes, quotes and newlines escaped. */
+static void write_sample(FILE* handle,
+                         const char* name,
+                         const char* suffix,
+                         const char* directory) {
+  fprintf(handle, METRIC_PREFIX "%s%s{directory=\"", name, suffix);
+  for (; *directory != '\0'; ++directory) {
+    if (*directory == '\n') {
+      fputs("\\n", handle);
+    } else {
+      if (*directory == '\\' || *directory == '"') {
+        putc('\\', handle);
+      }
+      putc(*directory, handle);
+    }
+  }
+  putc('"', handle);
+}
+
+static void write_histogram(FILE* handle,
+                            const char* name,
+                            const char* directory,
+                            const upload_histogram_t* histogram) {
+  uint64_t cumulative = 0;
+  int idx;
+  for (idx = 0; idx < histogram->num_bounds; ++idx) {
+    cumulative += histogram->counts[idx];
+    write_sample(handle, name, "_bucket", directory);
+    fprintf(handle,
+            ",le=\"%g\"} %" PRIu64 "\n",
+            histogram->bounds[idx],
+            cumulative);
+  }
+  write_sample(handle, name, "_bucket", directory);
+  fprintf(handle, ",le=\"+Inf\"} %" PRIu64 "\n", histogram->count);
+  write_sample(handle, name, "_sum", directory);
+  fprintf(handle, "} %.6f\n", histogram->sum);
+  write_sample(handle, name, "_count", directory);
+  fprintf(handle, "} %" PRIu64 "\n", histogram->count);
+}
+
+static void write_totals(FILE* handle, const upload_metrics_totals_t* totals) {
+  write_header(handle,
+               "inotify_overflows_total",
+               "Times the kernel's inotify queue overflowed.",
+               "counter");
+  fprintf(handle,
+          METRIC_PREFIX "inotify_overflows_total %" PRIu64 "\n",
+          totals->inotify_overflows);
+  write_header(handle,
+               "overflow_files_recovered_total",
+               "Files found by the rescans after inotify overflows.",
+               "counter");
+  fprintf(handle,
+          METRIC_PREFIX "overflow_files_recovered_total %" PRIu64 "\n",
+          totals->overflow_files_recovered);
+  write_header(handle,
+               "pending_files",
+               "Files waiting in the upload directories.",
+               "gauge");
+  fprintf(handle, METRIC_PREFIX "pending_files %d\n", totals->pending_files);
+  write_header(handle,
+               "pending_bytes",
+               "Bytes waiting in the upload directories.",
+               "gauge");
+  fprintf(handle,
+          METRIC_PREFIX "pending_bytes %lu\n",
+          (unsigned long)totals->pending_bytes);
+  write_header(handle, "active_uploads", "Transfers in progress.", "gauge");
+  fprintf(handle, METRIC_PREFIX "active_uploads %d\n", totals->active_uploads);
+  write_header(handle,
+               "queued_uploads",
+               "Uploads waiting for a free transfer slot.",
+               "gauge");
+  fprintf(handle, METRIC_PREFIX "queued_uploads %d\n", totals->queued_uploads);
+  write_header(handle,
+               "upload_concurrency",
+               "How many transfers may run at once.",
+               "gauge");
+  fprintf(handle,
+          METRIC_PREFIX "upload_concurrency %d\n",
+          totals->upload_concurrency);
+  write_header(handle,
+               "link_throughput_bytes_per_second",
+               "Estimated upload capacity of the link to the server.",
+               "gauge");
+  fprintf(handle,
+          METRIC_PREFIX "link_throughput_bytes_per_second %.0f\n",
+          totals->link_throughput);
+  write_header(handle,
+               "link_round_trip_seconds",
+               "Estimated round trip time to the server.",
+               "gauge");
+  fprintf(handle,
+          METRIC_PREFIX "link_round_trip_seconds %.6f\n",
+          totals->link_round_trip_time);
+}
+
+int upload_metrics_write(const char* filename,
+                         const upload_metrics_totals_t* totals,
+                         const char* const* directories,
+                         const upload_metrics_t* metrics,
+                         int num_directories) {
+  char temporary[PATH_MAX + 1];
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", filename)
+      >= (int)sizeof(temporary)) {
+    syslog(LOG_ERR, "upload_metrics_write: \"%s\" is too long", filename);
+    return -1;
+  }
+  FILE* handle = fopen(temporary, "w");
+  if (handle == NULL) {
+    syslog(LOG_ERR,
+           "upload_metrics_write:fopen(\"%s\"): %s",
+           temporary,
+           strerror(errno));
+    return -1;
+  }
+
+  write_totals(handle, totals);
+  /* Samples of one metric must be grouped under its header. */
+  int field;
+  int idx;
+  for (field = 0; field < ARRAY_LENGTH(counter_fields); ++field) {
+    write_header(handle,
+                 counter_fields[field].name,
+                 counter_fields[field].help,
+                 "counter");
+    for (idx = 0; idx < num_directories; ++idx) {
+      const char* base = (const char*)&metrics[idx];
+      write_sample(handle, counter_fields[field].name, "", directories[idx]);
+      fprintf(handle,
+              "} %" PRIu64 "\n",
+              *(const uint64_t*)(base + counter_fields[field].offset));
+    }
+  }
+  for (field = 0; field < ARRAY_LENGTH(histogram_fields); ++field) {
+    write_header(handle,
+                 histogram_fields[field].name,
+                 histogram_fields[field].help,
+                 "histogram");
+    for (idx = 0; idx < num_directories; ++idx) {
+      const char* base = (const char*)&metrics[idx];
+      write_histogram(
+          handle,
+          histogram_fields[field].name,
+          directories[idx],
+          (const upload_histogram_t*)(base + histogram_fields[field].offset));
+    }
+  }
+
+  /* stdio remembers any failed write; check once at the end. */
+  int failed = ferror(handle);
+  if (fclose(handle)) {
+    failed = 1;
+  }
+  if (failed) {
+    syslog(LOG_ERR,
+           "upload_metrics_write:fprintf(\"%s\"): %s",
+           temporary,
+           strerror(errno));
+    (void)unlink(temporary);
+    return -1;
+  }
+  if (rename(temporary, filename)) {
+    syslog(LOG_ERR,
+           "upload_metrics_write:rename(\"%s\"): %s",
+           temporary,
+           strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _BISMARK_DATA_TRANSMIT_UPLOAD_METRICS_H_
+#define _BISMARK_DATA_TRANSMIT_UPLOAD_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPLOAD_HISTOGRAM_MAX_BUCKETS  12
+
+/* A histogram of observations in seconds. counts[i] counts the observations
+ * no greater than bounds[i] but greater than the bound before it, and
+ * counts[num_bounds] the ones beyond the last bound. */
+typedef struct {
+  const double* bounds;
+  int num_bounds;
+  uint64_t counts[UPLOAD_HISTOGRAM_MAX_BUCKETS + 1];
+  uint64_t count;
+  double sum;
+} upload_histogram_t;
+
+/* What happened to one upload directory's files since the daemon started. */
+typedef struct {
+  /* Files handed to the upload engine, counting every attempt. */
+  uint64_t files_enqueued;
+  uint64_t files_uploaded;
+  /* Failed attempts to upload a file. */
+  uint64_t files_failed;
+  /* Files deleted to respect a quota. */
+  uint64_t files_evicted;
+  /* Request body bytes put on the wire, after compression. */
+  uint64_t bytes_sent;
+  /* From a file appearing in the directory to its upload succeeding. */
+  upload_histogram_t latency;
+  /* Connection setup, including the TLS handshake, for transfers that
+   * didn't reuse a connection. */
+  upload_histogram_t connect_time;
+  /* Whole successful transfers. */
+  upload_histogram_t transfer_time;
+} upload_metrics_t;
+
+/* Values that describe the daemon as a whole rather than one directory. */
+typedef struct {
+  uint64_t inotify_overflows;
+  uint64_t overflow_files_recovered;
+  int pending_files;
+  size_t pending_bytes;
+  int active_uploads;
+  int queued_uploads;
+  /* The engine's estimates of the link, 0 while unknown. */
+  int upload_concurrency;
+  double link_throughput;
+  double link_round_trip_time;
+} upload_metrics_totals_t;
+
+void upload_metrics_init(upload_metrics_t* metrics);
+
+void upload_histogram_observe(upload_histogram_t* histogram, double value);
+
+/* Write every metric to filename in the Prometheus text exposition format,
+ * labelling each directory's metrics with its name. The file is written
+ * under a temporary name and renamed into place, so a scraper never sees it
+ * half written. */
+int upload_metrics_write(const char* filename,
+                         const upload_metrics_totals_t* totals,
+                         const char* const* directories,
+                         const upload_metrics_t* metrics,
+                         int num_directories);
+
+#endif
@@ -0,0 +1,103 @@
+#include "upload_scan.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Room for several hundred entries per getdents64() call. */
+#define SCAN_BUFFER_SIZE  32768
+
+/* The record getdents64() fills in. Not every C library declares it. */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+void upload_scan_init(upload_scan_t* scan) {
+  scan->fd = -1;
+  scan->buffer = NULL;
+  scan->length = 0;
+  scan->offset = 0;
+}
+
+int upload_scan_open(upload_scan_t* scan, const char* directory) {
+  upload_scan_init(scan);
+  scan->fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (scan->fd < 0) {
+    syslog(LOG_ERR,
+           "upload_scan_open:open(\"%s\"): %s",
+           directory,
+           strerror(errno));
+    return -1;
+  }
+  scan->buffer = malloc(SCAN_BUFFER_SIZE);
+  if (scan->buffer == NULL) {
+    syslog(LOG_ERR, "upload_scan_open:malloc: %s", strerror(errno));
+    upload_scan_close(scan);
+    return -1;
+  }
+  return 0;
+}
+
+void upload_scan_close(upload_scan_t* scan) {
+  if (scan->fd >= 0) {
+    close(scan->fd);
+  }
+  free(scan->buffer);
+  upload_scan_init(scan);
+}
+
+int upload_scan_next(upload_scan_t* scan,
+                     const char** name,
+                     struct stat* file_info) {
+  if (scan->fd < 0) {
+    return 0;
+  }
+  while (1) {
+    if (scan->offset >= scan->length) {
+      long length = syscall(
+          SYS_getdents64, scan->fd, scan->buffer, SCAN_BUFFER_SIZE);
+      if (length < 0) {
+        syslog(LOG_ERR, "upload_scan_next:getdents64: %s", strerror(errno));
+        return -1;
+      } else if (length == 0) {
+        return 0;
+      }
+      scan->length = length;
+      scan->offset = 0;
+    }
+    const struct linux_dirent64* entry
+        = (const struct linux_dirent64*)(scan->buffer + scan->offset);
+    scan->offset += entry->d_reclen;
+    /* File systems that don't report types say DT_UNKNOWN; those have to be
+     * stat()ed like everything else. */
+    if ((entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN
+         && entry->d_type != DT_LNK)
+        || !strcmp(entry->d_name, ".")
+        || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    if (fstatat(scan->fd, entry->d_name, file_info, 0)) {
+      if (errno != ENOENT) {
+        syslog(LOG_ERR,
+               "upload_scan_next:fstatat(\"%s\"): %s",
+               entry->d_name,
+               strerror(errno));
+      }
+      continue;
+    }
+    if (S_ISREG(file_info->st_mode)) {
+      *name = entry->d_name;
+      return 1;
+    }
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef _BISMARK_DATA_TRANSMIT_UPLOAD_SCAN_H_
+#define _BISMARK_DATA_TRANSMIT_UPLOAD_SCAN_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Lists the regular files in a directory. Entries are fetched many at a
+ * time with getdents64() and examined with fstatat() relative to the
+ * directory's fd, so no path is resolved from the root for each file. A scan
+ * can be interrupted between files and resumed later. */
+typedef struct {
+  int fd;  /* The directory, or -1. */
+  char* buffer;
+  long length;
+  long offset;
+} upload_scan_t;
+
+void upload_scan_init(upload_scan_t* scan);
+
+int upload_scan_open(upload_scan_t* scan, const char* directory);
+void upload_scan_close(upload_scan_t* scan);
+
+/* Fetch the next regular file in the directory. *name stays valid until the
+ * next call. Return 1 if a file was found, 0 at the end of the directory and
+ * -1 on error. */
+int upload_scan_next(upload_scan_t* scan,
+                     const char** name,
+                     struct stat* file_info);
+
+#endif
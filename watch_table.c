@@ -0,0 +1,64 @@
+#include "watch_table.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define INITIAL_CAPACITY  64
+
+void watch_table_init(watch_table_t* table) {
+  table->indices = NULL;
+  table->capacity = 0;
+}
+
+void watch_table_destroy(watch_table_t* table) {
+  free(table->indices);
+  watch_table_init(table);
+}
+
+static int reserve(watch_table_t* table, int wd) {
+  if (wd < table->capacity) {
+    return 0;
+  }
+  int capacity = table->capacity > 0 ? table->capacity : INITIAL_CAPACITY;
+  while (capacity <= wd) {
+    capacity *= 2;
+  }
+  int* indices = realloc(table->indices, capacity * sizeof(indices[0]));
+  if (indices == NULL) {
+    syslog(LOG_ERR, "watch_table_set:realloc: %s", strerror(errno));
+    return -1;
+  }
+  int idx;
+  for (idx = table->capacity; idx < capacity; ++idx) {
+    indices[idx] = -1;
+  }
+  table->indices = indices;
+  table->capacity = capacity;
+  return 0;
+}
+
+int watch_table_set(watch_table_t* table, int wd, int index) {
+  if (wd < 0) {
+    return -1;
+  }
+  if (reserve(table, wd)) {
+    return -1;
+  }
+  table->indices[wd] = index;
+  return 0;
+}
+
+void watch_table_remove(watch_table_t* table, int wd) {
+  if (wd >= 0 && wd < table->capacity) {
+    table->indices[wd] = -1;
+  }
+}
+
+int watch_table_lookup(const watch_table_t* table, int wd) {
+  if (wd < 0 || wd >= table->capacity) {
+    return -1;
+  }
+  return table->indices[wd];
+}
@@ -0,0 +1,25 @@
+#ifndef _BISMARK_DATA_TRANSMIT_WATCH_TABLE_H_
+#define _BISMARK_DATA_TRANSMIT_WATCH_TABLE_H_
+
+/* Maps inotify watch descriptors to upload directory indices. The kernel
+ * hands out watch descriptors as small increasing integers, so the table is
+ * a plain array indexed by descriptor that grows as needed; unused slots
+ * hold -1. */
+typedef struct {
+  int* indices;
+  int capacity;
+} watch_table_t;
+
+void watch_table_init(watch_table_t* table);
+void watch_table_destroy(watch_table_t* table);
+
+/* Map wd to index, replacing any previous mapping. */
+int watch_table_set(watch_table_t* table, int wd, int index);
+
+/* Forget wd. Unknown descriptors are ignored. */
+void watch_table_remove(watch_table_t* table, int wd);
+
+/* The index mapped to wd, or -1. */
+int watch_table_lookup(const watch_table_t* table, int wd);
+
+#endif